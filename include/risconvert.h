@@ -0,0 +1,540 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <memory>
+#include <array>
+#include <functional>
+
+struct end_of_stream : std::exception {
+	const char * what() const noexcept { return "end of stream"; }
+};
+
+struct istream {
+	inline virtual ~istream() noexcept = default;
+	virtual size_t try_read(void * buffer, size_t amount) = 0;
+	void read(void * buffer, size_t amount);
+	template<typename T> void read(T & value);
+	template<typename T> T read();
+};
+
+template<typename T>
+inline void istream::read(T & value) {
+	read(&value, sizeof(T));
+}
+
+template<typename T>
+inline T istream::read() {
+	T tmp;
+	read(&tmp, sizeof(T));
+	return tmp;
+}
+
+struct ostream {
+	inline virtual ~ostream() noexcept = default;
+	virtual size_t try_write(const void * buffer, size_t amount) = 0;
+	void write(const void * buffer, size_t amount);
+	template<typename T> void write(const T & value);
+	virtual void flush() {}
+};
+
+template<typename T>
+inline void ostream::write(const T & value) {
+	write(&value, sizeof(T));
+}
+
+struct iostream : istream, ostream {
+	inline virtual ~iostream() noexcept = default;
+};
+
+struct ifstream : istream {
+	enum class advice { will_need, dont_need };
+
+	inline virtual ~ifstream() noexcept = default;
+	static std::unique_ptr<ifstream> open(const std::string & filename);
+	virtual void seek(size_t offset) = 0;
+	// Tells the kernel that size bytes at offset will be read soon, or that
+	// they have been and need not stay cached.  Only a hint, so streams that
+	// cannot pass it on ignore it.
+	virtual void advise(size_t, size_t, advice) noexcept {}
+	// Reports the descriptor and offset of the next byte when the stream
+	// reads from a file, so the kernel can move data on its behalf.
+	virtual bool locate(int &, size_t &) noexcept { return false; }
+};
+
+struct ibufstream : ifstream {
+	static constexpr size_t default_block_size = 64 * 1024;
+	inline virtual ~ibufstream() noexcept = default;
+	static std::unique_ptr<ibufstream> open(const std::string & filename, size_t block_size = default_block_size);
+	// Like open(), but reads regular files ahead through io_uring.
+	static std::unique_ptr<ibufstream> open_uring(const std::string & filename, size_t block_size = default_block_size);
+	static std::unique_ptr<ibufstream> wrap(istream & stream, size_t block_size = default_block_size);
+	static std::unique_ptr<ibufstream> wrap(ifstream & stream, size_t block_size = default_block_size);
+	// Reads size bytes at data in place; they must outlive the stream.
+	static std::unique_ptr<ibufstream> view(const void * data, size_t size);
+	// Points data at the bytes ahead of the read position, refilling if
+	// none are buffered, and returns how many there are (0 at the end).
+	virtual size_t peek(const uint8_t *& data) = 0;
+	// Advances the read position over bytes returned by peek().
+	virtual void consume(size_t amount) noexcept = 0;
+	// Streams that cannot seek only support seeking forward, which skips.
+	virtual bool seekable() const noexcept = 0;
+};
+
+struct ofstream : iostream {
+	inline virtual ~ofstream() noexcept = default;
+	// Truncates filename, or replaces it when it is one of several links to
+	// the same file, so that the others keep what they hold.
+	static std::unique_ptr<ofstream> create(const std::string & filename);
+	virtual void seek(size_t offset) = 0;
+	virtual bool locate(int &, size_t &) noexcept { return false; }
+};
+
+struct obufstream : ofstream {
+	static constexpr size_t default_block_size = 256 * 1024;
+	inline virtual ~obufstream() noexcept = default;
+	// Creates filename with room reserved for size bytes, which is only a
+	// hint: the file ends up as long as what was written to it.
+	static std::unique_ptr<obufstream> create(const std::string & filename, size_t size, size_t block_size = default_block_size);
+	// Like create(), but writes through a shared mapping of the file.
+	static std::unique_ptr<obufstream> map(const std::string & filename, size_t size);
+	// Like create(), but queues its writes on this thread's io_uring.
+	static std::unique_ptr<obufstream> create_uring(const std::string & filename, size_t size);
+	static std::unique_ptr<obufstream> wrap(ofstream & stream, size_t block_size = default_block_size);
+	// Points data at free space ahead of the write position, making room
+	// if there is none, and returns how much there is.
+	virtual size_t reserve(uint8_t *& data) = 0;
+	// Advances the write position over bytes stored through reserve().
+	virtual void commit(size_t amount) noexcept = 0;
+};
+
+struct ilzrwstream : istream {
+	inline virtual ~ilzrwstream() noexcept = default;
+	static std::unique_ptr<ilzrwstream> wrap(istream &, size_t block_size = ibufstream::default_block_size);
+	static std::unique_ptr<ilzrwstream> wrap(ibufstream &);
+};
+
+// Collects bitmaps into a single output rather than a file each.  add()
+// may be called from several threads at once; entries are stored in the
+// order the calls are made.
+struct container {
+	inline virtual ~container() noexcept = default;
+	// Writes an uncompressed tar stream to stream, or to filename, where "-"
+	// stands for standard output.
+	static std::unique_ptr<container> tar(ostream & stream);
+	static std::unique_ptr<container> tar(const std::string & filename);
+	virtual void add(const std::string & name, const void * data, size_t size) = 0;
+	// Adds size bytes that write streams into the output.  Other adds wait
+	// until it returns, and a write that fails or falls short leaves the
+	// container unusable.
+	virtual void add(const std::string & name, size_t size, const std::function<void(obufstream &)> & write) = 0;
+	// Ends the container; nothing may be added afterwards.
+	virtual void finish() = 0;
+};
+
+// Counters of the work a thread has done.  They are always kept, at the
+// cost of an add per system call, io_uring request or decoded block; entry
+// times are only taken for extract_options::stats.
+struct extract_stats {
+	// Reads and seeks of file input streams, and io_uring reads.
+	uint64_t read_calls = 0;
+	uint64_t read_bytes = 0;
+	uint64_t seek_calls = 0;
+	// Writes of file output streams, and io_uring writes.
+	uint64_t write_calls = 0;
+	uint64_t write_bytes = 0;
+	// copy_file_range(2) and sendfile(2) calls of plain bitmaps.
+	uint64_t copy_calls = 0;
+	uint64_t copy_bytes = 0;
+	// What the LZRW decoder produced; literals are single bytes.
+	uint64_t literals = 0;
+	uint64_t matches = 0;
+	uint64_t match_bytes = 0;
+	uint64_t entries = 0;
+	uint64_t entry_bytes = 0;
+	uint64_t entry_nanoseconds = 0;
+	uint64_t max_entry_nanoseconds = 0;
+
+	static extract_stats & local() noexcept;
+	void add(const extract_stats & other) noexcept;
+};
+
+// Caps the memory taken up at once by bitmaps that are staged whole, which
+// are those bound for a container or an image_encoder.  Output to files
+// streams through fixed blocks per thread and is not counted.
+struct memory_budget {
+	inline virtual ~memory_budget() noexcept = default;
+	static std::unique_ptr<memory_budget> create(size_t limit);
+	virtual size_t limit() const noexcept = 0;
+	// Waits, first come first served, until size bytes are free.  A request
+	// for more than the limit waits until nothing else is held.
+	virtual void acquire(size_t size) = 0;
+	virtual void release(size_t size) noexcept = 0;
+};
+
+// Holds size bytes of a budget, if there is one, until destroyed.
+struct memory_lease {
+	memory_budget * m_budget;
+	size_t m_size;
+
+	inline memory_lease() noexcept
+	: m_budget(nullptr)
+	, m_size(0)
+	{}
+
+	inline memory_lease(memory_budget * budget, const size_t size)
+	: m_budget(budget)
+	, m_size(size) {
+		if (m_budget != nullptr) {
+			m_budget->acquire(m_size);
+		}
+	}
+
+	inline memory_lease(memory_lease && other) noexcept
+	: m_budget(other.m_budget)
+	, m_size(other.m_size) {
+		other.m_budget = nullptr;
+	}
+
+	inline memory_lease & operator=(memory_lease && other) noexcept {
+		std::swap(m_budget, other.m_budget);
+		std::swap(m_size, other.m_size);
+		return *this;
+	}
+
+	inline ~memory_lease() noexcept {
+		if (m_budget != nullptr) {
+			m_budget->release(m_size);
+		}
+	}
+};
+
+// Converts bitmaps to another format on a pool of its own threads, so that
+// decoding and encoding overlap.  add() may be called from any thread and
+// waits while the queue is full.
+struct image_encoder {
+	inline virtual ~image_encoder() noexcept = default;
+	// Writes PNG files on threads threads; fails if built without libpng.
+	static std::unique_ptr<image_encoder> png(size_t threads);
+	// The extension of the files written, such as ".png".
+	virtual const char * extension() const noexcept = 0;
+	// Hands out a buffer for add(), reusing one from an earlier bitmap.
+	virtual std::vector<uint8_t> acquire() = 0;
+	// Queues a BMP image to be written to filename, holding on to lease
+	// until it has been.
+	virtual void add(const std::string & filename, std::vector<uint8_t> bitmap, memory_lease lease = memory_lease{}) = 0;
+	// Waits for the queue to drain and returns how many bitmaps could not
+	// be converted; each of them is reported on stderr.
+	virtual size_t finish() = 0;
+};
+
+// An inclusive run of entry numbers.
+struct entry_range {
+	size_t first;
+	size_t last;
+};
+
+struct extract_options {
+	bool map_output = false;
+	bool io_uring = false;
+	// Leaves stdout alone; errors are still reported on stderr.
+	bool quiet = false;
+	// Looks entries up in, and keeps up to date, a sidecar index next to
+	// each archive instead of reading its header.
+	bool use_index = false;
+	// Entries to extract; empty selects all of them.
+	std::vector<entry_range> entries;
+	// Entries to extract from each input in turn, taking the place of
+	// entries for as many inputs as it covers.
+	std::vector<std::vector<entry_range>> input_entries;
+	// Receives the bitmaps in place of .N.bmp files when set.  Inputs that
+	// cannot seek add theirs in the order they are stored, not by index.
+	container * output = nullptr;
+	// Converts the bitmaps before they are written when set.
+	image_encoder * encoder = nullptr;
+	// Bounds the bitmaps held for the container or encoder when set.
+	memory_budget * memory = nullptr;
+	// Checks every selected entry and decodes it into a discarding sink
+	// instead of writing anything.
+	bool verify = false;
+	// Drops the pages of each archive from the page cache once read.
+	bool drop_input = false;
+	// Collects the counters of every worker thread and times each entry
+	// when set.
+	extract_stats * stats = nullptr;
+	// Keeps decoded compressed bitmaps here, keyed by the hash of the bytes
+	// they were decoded from, and links them into place on later runs.
+	// Empty turns the cache off.
+	std::string cache_directory;
+};
+
+// Formats a message into a runtime_error, printf style.
+std::runtime_error error(const char * format, ...);
+
+std::string derive_output_filename(
+	const std::string & input_filename,
+	size_t index
+);
+
+// Output filenames for the entries of one archive.  The stem is worked out
+// once and each call only rewrites the index in place, so naming an entry
+// does not allocate.  The returned name is valid until the next call.
+struct bitmap_names {
+	std::string m_name;
+	size_t m_stem;
+	const char * m_extension;
+
+	explicit bitmap_names(const std::string & input_filename, const char * extension = ".bmp");
+
+	const std::string & operator()(size_t index);
+};
+
+void export_bitmap(
+	istream & input,
+	const std::string & filename,
+	size_t amount,
+	const extract_options & options
+);
+
+void export_bitmap(
+	ibufstream & input,
+	const std::string & filename,
+	size_t amount,
+	const extract_options & options
+);
+
+// The entry occupies [offset, end) of the archive, which its data must fit
+// in when end is known.  The decode cache is only consulted then, too.
+void export_plain_bitmap(
+	ibufstream & stream,
+	bitmap_names & names,
+	size_t index,
+	const extract_options & options,
+	size_t offset = 0,
+	size_t end = SIZE_MAX
+);
+
+// Like export_plain_bitmap(), for an LZRW-compressed entry.
+void export_compressed_bitmap(
+	ibufstream & stream,
+	bitmap_names & names,
+	size_t index,
+	const extract_options & options,
+	size_t offset = 0,
+	size_t end = SIZE_MAX
+);
+
+bool is_bitmap_list(const std::array<char, 8> & magic) noexcept;
+
+// Reads the header of an archive up to and including its offsets table.
+// Returns false for a valid archive that holds no bitmap list, and fails
+// on a table of more than limit entries.
+bool read_offsets(istream & stream, std::vector<uint32_t> & offsets, size_t limit = SIZE_MAX);
+
+// One entry as recorded in an archive's sidecar index.  size2 is zero for
+// plain entries and type is whatever the archive holds at offset.
+struct archive_entry {
+	uint32_t offset;
+	uint8_t type;
+	uint32_t size1;
+	uint32_t size2;
+};
+
+std::string index_filename(const std::string & archive_filename);
+
+// Reads the type and sizes of every entry in offsets.
+std::vector<archive_entry> scan_entries(ibufstream & stream, const std::vector<uint32_t> & offsets);
+
+// Loads the sidecar index of an archive.  Returns false when there is
+// none or the archive has changed since it was written.
+bool load_index(const std::string & archive_filename, std::vector<archive_entry> & entries);
+
+void save_index(const std::string & archive_filename, const std::vector<archive_entry> & entries);
+
+// How far decoding of an entry has got, for carrying on from there in
+// later calls.  It holds no pointers, so it can be saved as it is and
+// loaded again by another process; a value-initialised state is the start
+// of an entry.
+struct lzrw_state {
+	// The last 4096 bytes produced, which matches refer back into.
+	uint8_t window[4096];
+	uint16_t window_index;
+	// The rest of the current control word and the rest of a match that
+	// did not fit in the last slice.
+	uint16_t control_bits;
+	uint8_t control_remaining;
+	uint8_t match_remaining;
+	uint16_t match_distance;
+	// Bytes of the entry's payload read and of its bitmap produced so far.
+	uint64_t input;
+	uint64_t output;
+};
+
+// An archive opened for decoding its entries in-process, without touching
+// the filesystem or stdout.  It reads through a single stream, so use one
+// per thread; a stream returned by open_entry() is only good until the
+// next call on the archive.  An entry is never decoded from bytes past the
+// start of the next one up, or past the end of the file opened.
+struct archive {
+	inline virtual ~archive() noexcept = default;
+	static std::unique_ptr<archive> open(const std::string & filename);
+	// Reads from stream, which must be seekable and outlive the archive.
+	static std::unique_ptr<archive> wrap(ibufstream & stream);
+	// The number of entries.
+	virtual size_t size() const noexcept = 0;
+	virtual archive_entry entry(size_t index) = 0;
+	// Streams the bitmap of entry index.
+	virtual std::unique_ptr<istream> open_entry(size_t index) = 0;
+	// Decodes the bitmap of entry index into buffer and returns its size,
+	// which is entry(index).size1; fails if that exceeds capacity.
+	virtual size_t decode(size_t index, void * buffer, size_t capacity) = 0;
+	// Decodes up to capacity more bytes of the bitmap of entry index from
+	// where state has got to, updates state and returns how many there
+	// were; 0 once state.output reaches entry(index).size1.
+	virtual size_t decode_slice(size_t index, lzrw_state & state, void * buffer, size_t capacity) = 0;
+};
+
+// Receives what an archive_parser finds, from within its feed() calls.
+struct archive_handler {
+	inline virtual ~archive_handler() noexcept = default;
+	// The archive has count entries.
+	virtual void begin_archive(size_t) {}
+	virtual void begin_entry(size_t, const archive_entry &) {}
+	// The next size bytes of the bitmap of entry index.
+	virtual void entry_data(size_t index, const void * data, size_t size) = 0;
+	virtual void end_entry(size_t) {}
+};
+
+// Extracts entries from an archive pushed in as it arrives, for callers
+// that cannot block on reads, such as an event loop with many archives in
+// flight.  Entries are decoded in the order of their offsets, so the input
+// only ever moves forward.
+struct archive_parser {
+	inline virtual ~archive_parser() noexcept = default;
+	// Picks the entries to extract as extract_options::entries does.
+	static std::unique_ptr<archive_parser> create(archive_handler & handler, const std::vector<entry_range> & entries = {});
+	// Takes the next size bytes of the archive.  Anything the handler
+	// throws is passed on.
+	virtual void feed(const void * data, size_t size) = 0;
+	// The archive offset of the next byte needed, after bytes it has no
+	// use for.  A caller that can seek may skip to it.
+	virtual uint64_t wanted() const noexcept = 0;
+	virtual void skip(uint64_t offset) = 0;
+	// Whether every selected entry is done, after which input is ignored.
+	virtual bool done() const noexcept = 0;
+	// Ends the input; fails unless done().
+	virtual void finish() = 0;
+};
+
+// Compresses size bytes at data into the form ilzrwstream reads and
+// appends them to output.
+void lzrw_compress(const void * data, size_t size, std::vector<uint8_t> & output);
+
+// Writes an archive of count entries to filename, added one at a time in
+// order.
+struct archive_writer {
+	inline virtual ~archive_writer() noexcept = default;
+	static std::unique_ptr<archive_writer> create(const std::string & filename, size_t count);
+	// Stores size bytes as they are.
+	virtual void add(const void * data, size_t size) = 0;
+	// Stores an entry of size bytes given as compressed by lzrw_compress().
+	virtual void add_compressed(size_t size, const void * compressed, size_t compressed_size) = 0;
+	// Fills in the offsets table; fails unless all count entries were added.
+	virtual void finish() = 0;
+};
+
+// Stores each of input_filenames, in order, as an entry of archive_filename,
+// compressing them on jobs threads unless compress is false.  Entries that
+// do not shrink are stored as they are.
+void pack(
+	const std::string & archive_filename,
+	const std::vector<std::string> & input_filenames,
+	size_t jobs,
+	bool compress = true
+);
+
+struct cache_counters {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t items;
+	uint64_t bytes;
+};
+
+// Keeps archives mapped with their offsets tables read, and the bitmaps
+// decoded from them, each layer up to a number of bytes in all.
+// Up to max_open archives are kept open.  It may be used from any number
+// of threads.
+struct entry_cache {
+	inline virtual ~entry_cache() noexcept = default;
+	static std::unique_ptr<entry_cache> create(size_t header_bytes, size_t bitmap_bytes, size_t max_open = 64);
+	// The bitmap of entry index of the archive at filename, decoded unless
+	// it was already.  An archive is read again once its file changes.
+	virtual std::shared_ptr<const std::vector<uint8_t>> get(const std::string & filename, size_t index) = 0;
+	virtual cache_counters header_counters() = 0;
+	virtual cache_counters bitmap_counters() = 0;
+};
+
+// The entries of one archive in a work manifest.
+struct manifest_archive {
+	std::string filename;
+	std::vector<archive_entry> entries;
+};
+
+// Reads the offsets table and entry headers of every input on jobs
+// threads, or their sidecar indexes when use_index is set, and appends
+// them to manifest.  Inputs that cannot be read are reported on stderr and
+// left out; returns how many there were.
+size_t plan_manifest(
+	const std::vector<std::string> & input_filenames,
+	size_t jobs,
+	bool use_index,
+	std::vector<manifest_archive> & manifest
+);
+
+// A manifest is text: its first line names the format, then each archive
+// has a line "archive path" followed by one "index offset type size1 size2"
+// line per entry.  "-" stands for stdout or stdin.
+void save_manifest(const std::string & filename, const std::vector<manifest_archive> & manifest);
+std::vector<manifest_archive> load_manifest(const std::string & filename);
+
+// A guess at the work of extracting entry, in bytes of plain output.
+uint64_t entry_cost(const archive_entry & entry) noexcept;
+
+// Splits the entries of manifest into count shards of about equal cost and
+// returns the entries of each archive that fall to shard, which counts
+// from 0.  Every caller given the same manifest gets the same split.
+std::vector<std::vector<entry_range>> shard_manifest(
+	const std::vector<manifest_archive> & manifest,
+	size_t shard,
+	size_t count
+);
+
+// Serves decoded entries from cache on a Unix stream socket at socket_path
+// with jobs threads, each answering one connection at a time, and never
+// returns unless it fails.  A request is a line "N path", and the answer is
+// "OK size" and a newline followed by the bitmap of entry N, or "ERR " and
+// a message on a line of its own.  "stats" is answered with the counters
+// of the cache in place of a bitmap.  Connections take any number of
+// requests.  The socket is made accessible to its owner only.
+void serve(const std::string & socket_path, size_t jobs, entry_cache & cache);
+
+void extract_entry(
+	ibufstream & stream,
+	bitmap_names & names,
+	size_t index,
+	size_t offset,
+	const extract_options & options,
+	size_t end = SIZE_MAX
+);
+
+// Extracts the selected entries of every input on jobs threads and returns the
+// number of inputs that failed.
+size_t extract(
+	const std::vector<std::string> & input_filenames,
+	size_t jobs,
+	const extract_options & options
+);
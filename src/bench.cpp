@@ -0,0 +1,287 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <system_error>
+#include <unistd.h>
+#include <risconvert.h>
+
+struct bench_options {
+	size_t entries = 2000;
+	size_t size = 16 * 1024;
+	double plain = 0.5;
+	double compressibility = 0.7;
+	size_t repeats = 3;
+	size_t jobs = 1;
+	unsigned seed = 1;
+	std::string directory;
+};
+
+struct corpus {
+	std::string filename;
+	std::vector<uint32_t> offsets;
+	std::vector<uint8_t> types;
+	size_t plain_bytes = 0;
+	size_t compressed_bytes = 0;
+	size_t archive_bytes = 0;
+};
+
+// Makes size bytes in which roughly the given share of runs repeat
+// something from the 4K before them, and compresses them the way a packed
+// archive would hold them.
+void generate_entry(
+	std::mt19937 & random,
+	const size_t size,
+	const double compressibility,
+	std::vector<uint8_t> & raw,
+	std::vector<uint8_t> & compressed
+) {
+	raw.clear();
+	compressed.clear();
+	std::uniform_real_distribution<double> chance(0, 1);
+	while (raw.size() < size) {
+		const auto left = size - raw.size();
+		if (raw.size() > 0 && left >= 3 && chance(random) < compressibility) {
+			const auto distance = std::uniform_int_distribution<size_t>(1, std::min<size_t>(raw.size(), 4095))(random);
+			const auto len = std::uniform_int_distribution<size_t>(3, std::min<size_t>(left, 16))(random);
+			for (size_t i = 0; i < len; ++i) {
+				raw.push_back(raw[raw.size() - distance]);
+			}
+		} else {
+			raw.push_back(uint8_t(random()));
+		}
+	}
+	lzrw_compress(raw.data(), raw.size(), compressed);
+}
+
+corpus generate(const bench_options & options) {
+	corpus result;
+	result.filename = options.directory + "/bench.ris";
+	std::mt19937 random(options.seed);
+	std::uniform_real_distribution<double> chance(0, 1);
+	std::uniform_int_distribution<size_t> sizes(options.size / 2, options.size + options.size / 2);
+
+	const auto count = options.entries;
+	const auto output = archive_writer::create(result.filename, count);
+	size_t offset = 1 + 8 + 4 + count * sizeof(uint32_t);
+	result.offsets.resize(count);
+	result.types.resize(count);
+	std::vector<uint8_t> raw;
+	std::vector<uint8_t> compressed;
+	for (size_t i = 0; i < count; ++i) {
+		const auto size = sizes(random);
+		generate_entry(random, size, options.compressibility, raw, compressed);
+		result.offsets[i] = uint32_t(offset);
+		if (chance(random) < options.plain) {
+			result.types[i] = 8;
+			result.plain_bytes += raw.size();
+			output->add(raw.data(), raw.size());
+			offset += 1 + 4 + raw.size();
+		} else {
+			result.types[i] = 9;
+			result.compressed_bytes += raw.size();
+			output->add_compressed(raw.size(), compressed.data(), compressed.size());
+			offset += 1 + 4 + 4 + 1 + compressed.size();
+		}
+	}
+	output->finish();
+	result.archive_bytes = offset;
+	return result;
+}
+
+void remove_outputs(const corpus & corpus) {
+	for (size_t i = 0; i < corpus.offsets.size(); ++i) {
+		::unlink(derive_output_filename(corpus.filename, i).c_str());
+	}
+}
+
+struct measurement {
+	std::string name;
+	std::string backend;
+	size_t jobs;
+	size_t bytes;
+	double best;
+	double mean;
+};
+
+template<typename F>
+measurement measure(
+	const bench_options & options,
+	const char * name,
+	const char * backend,
+	const size_t bytes,
+	F run
+) {
+	measurement result{name, backend, 1, bytes, 0, 0};
+	double total = 0;
+	for (size_t i = 0; i < options.repeats; ++i) {
+		const auto start = std::chrono::steady_clock::now();
+		run();
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		total += elapsed.count();
+		result.best = i == 0 ? elapsed.count() : std::min(result.best, elapsed.count());
+	}
+	result.mean = total / options.repeats;
+	return result;
+}
+
+// Decodes every type-9 entry into memory.
+void bench_decode(const corpus & corpus) {
+	const auto stream = ibufstream::open(corpus.filename);
+	std::vector<uint8_t> buffer;
+	for (size_t i = 0; i < corpus.offsets.size(); ++i) {
+		if (corpus.types[i] == 9) {
+			stream->seek(corpus.offsets[i] + 1);
+			const auto size1 = stream->read<uint32_t>();
+			stream->read<uint32_t>();
+			stream->read<uint8_t>();
+			buffer.resize(size1);
+			ilzrwstream::wrap(*stream)->read(buffer.data(), size1);
+		}
+	}
+}
+
+// Writes every type-8 entry out through export_bitmap().
+void bench_copy(const corpus & corpus) {
+	const auto stream = ibufstream::open(corpus.filename);
+	const extract_options options;
+	for (size_t i = 0; i < corpus.offsets.size(); ++i) {
+		if (corpus.types[i] == 8) {
+			stream->seek(corpus.offsets[i] + 1);
+			const auto size = stream->read<uint32_t>();
+			export_bitmap(*stream, derive_output_filename(corpus.filename, i), size, options);
+		}
+	}
+}
+
+void print_json(FILE * out, const bench_options & options, const corpus & corpus, const std::vector<measurement> & results) {
+	const auto plain = std::count(corpus.types.begin(), corpus.types.end(), 8);
+	fprintf(out, "{\n");
+	fprintf(out, "\t\"corpus\": {\"entries\": %zu, \"plain\": %zu, \"compressed\": %zu, "
+		"\"plain_bytes\": %zu, \"compressed_bytes\": %zu, \"archive_bytes\": %zu, "
+		"\"compressibility\": %g, \"seed\": %u},\n",
+		corpus.offsets.size(), size_t(plain), corpus.offsets.size() - plain,
+		corpus.plain_bytes, corpus.compressed_bytes, corpus.archive_bytes,
+		options.compressibility, options.seed);
+	fprintf(out, "\t\"results\": [\n");
+	for (size_t i = 0; i < results.size(); ++i) {
+		const auto & result = results[i];
+		fprintf(out, "\t\t{\"name\": \"%s\", \"backend\": \"%s\", \"jobs\": %zu, \"bytes\": %zu, "
+			"\"best_seconds\": %.6f, \"mean_seconds\": %.6f, \"mib_per_second\": %.1f}%s\n",
+			result.name.c_str(), result.backend.c_str(), result.jobs, result.bytes,
+			result.best, result.mean, result.best > 0 ? result.bytes / result.best / (1024 * 1024) : 0.0,
+			i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "\t]\n}\n");
+}
+
+size_t parse_size(const char * text) {
+	char * end;
+	errno = 0;
+	const auto value = strtoull(text, &end, 10);
+	if (errno != 0 || end == text || *end != '\0') {
+		throw error("invalid number: %s", text);
+	} else {
+		return value;
+	}
+}
+
+double parse_ratio(const char * text) {
+	char * end;
+	const auto value = strtod(text, &end);
+	if (end == text || *end != '\0' || value < 0 || value > 1) {
+		throw error("invalid ratio: %s", text);
+	} else {
+		return value;
+	}
+}
+
+int main(int argc, char ** argv) {
+	bench_options options;
+	for (int opt; (opt = getopt(argc, argv, "n:s:p:c:r:j:S:d:")) != -1;) {
+		switch (opt) {
+		case 'n':
+			options.entries = parse_size(optarg);
+			break;
+		case 's':
+			options.size = parse_size(optarg);
+			break;
+		case 'p':
+			options.plain = parse_ratio(optarg);
+			break;
+		case 'c':
+			options.compressibility = parse_ratio(optarg);
+			break;
+		case 'r':
+			options.repeats = std::max<size_t>(parse_size(optarg), 1);
+			break;
+		case 'j':
+			options.jobs = std::max<size_t>(parse_size(optarg), 1);
+			break;
+		case 'S':
+			options.seed = unsigned(parse_size(optarg));
+			break;
+		case 'd':
+			options.directory = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n entries] [-s size] [-p plain] [-c compressibility] "
+				"[-r repeats] [-j jobs] [-S seed] [-d directory]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	char temporary[] = "/tmp/risconvert-bench.XXXXXX";
+	const auto own_directory = options.directory.empty();
+	if (own_directory) {
+		if (::mkdtemp(temporary) == nullptr) {
+			throw std::system_error(errno, std::system_category());
+		}
+		options.directory = temporary;
+	}
+
+	const auto corpus = generate(options);
+	const auto total = corpus.plain_bytes + corpus.compressed_bytes;
+	std::vector<measurement> results;
+	results.push_back(measure(options, "lzrw_decode", "memory", corpus.compressed_bytes, [&corpus] {
+		bench_decode(corpus);
+	}));
+	results.push_back(measure(options, "export_bitmap", "default", corpus.plain_bytes, [&corpus] {
+		bench_copy(corpus);
+	}));
+	remove_outputs(corpus);
+
+	struct backend {
+		const char * name;
+		extract_options options;
+	};
+	backend backends[3];
+	backends[0].name = "default";
+	backends[1].name = "mmap";
+	backends[1].options.map_output = true;
+	backends[2].name = "io_uring";
+	backends[2].options.io_uring = true;
+	for (auto & backend : backends) {
+		backend.options.quiet = true;
+		auto result = measure(options, "extract", backend.name, total, [&] {
+			if (extract({corpus.filename}, options.jobs, backend.options) > 0) {
+				throw error("extract failed");
+			}
+		});
+		result.jobs = options.jobs;
+		results.push_back(result);
+		remove_outputs(corpus);
+	}
+
+	::unlink(corpus.filename.c_str());
+	if (own_directory) {
+		::rmdir(options.directory.c_str());
+	}
+	print_json(stdout, options, corpus, results);
+	return 0;
+}
@@ -0,0 +1,719 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <system_error>
+#include <unistd.h>
+#include <risconvert.h>
+
+struct fuzz_options {
+	size_t cases = 5000;
+	size_t size = 16 * 1024;
+	unsigned seed = 1;
+	unsigned timeout = 10;
+	std::string failure = "fuzz-failure.ris";
+	std::vector<std::string> archives;
+};
+
+// An LZRW payload and the bitmap size its entry claims.
+struct fuzz_case {
+	const char * kind;
+	std::vector<uint8_t> input;
+	size_t size;
+	// The bytes that went into lzrw_compress(), which the decoders must
+	// give back, or empty when the input was made some other way.
+	std::vector<uint8_t> original;
+};
+
+// Decodes one byte at a time, straight from the description of the
+// format, for the decoders in the library to be checked against.  Returns
+// how many of the amount bytes there were before the input ran out, and
+// sets consumed to how much input that took; a control word or token cut
+// off by the end of the input uses up what is left of it.
+size_t reference_decode(const uint8_t * input, const size_t size, uint8_t * output, const size_t amount, size_t & consumed) {
+	uint8_t window[4096] = {};
+	size_t index = 0;
+	size_t position = 0;
+	size_t produced = 0;
+	consumed = size;
+	while (produced < amount) {
+		if (size - position < 2) {
+			return produced;
+		}
+		unsigned control = input[position] | (input[position + 1] << 8);
+		position += 2;
+		for (unsigned bit = 0; bit < 16 && produced < amount; ++bit, control >>= 1) {
+			if (control & 0x1) {
+				if (size - position < 2) {
+					return produced;
+				}
+				const unsigned token = input[position] | (input[position + 1] << 8);
+				position += 2;
+				const size_t ofs = ((token & 0xf000) >> 4) | (token & 0xff);
+				const size_t distance = ofs > 0 ? ofs : sizeof(window);
+				const size_t len = ((token & 0xf00) >> 8) + 1;
+				for (size_t i = 0; i < len && produced < amount; ++i) {
+					const auto value = window[(index + sizeof(window) - distance) % sizeof(window)];
+					window[index] = value;
+					index = (index + 1) % sizeof(window);
+					output[produced++] = value;
+				}
+			} else {
+				if (position == size) {
+					return produced;
+				}
+				const auto value = input[position++];
+				window[index] = value;
+				index = (index + 1) % sizeof(window);
+				output[produced++] = value;
+			}
+		}
+	}
+	consumed = position;
+	return produced;
+}
+
+// Hands out what it holds a few bytes at a time, as a pipe might.
+struct chunked_istream final : istream {
+	const uint8_t * m_data;
+	size_t m_size;
+	size_t m_position;
+	std::mt19937 & m_random;
+	size_t m_chunk;
+
+	inline chunked_istream(const std::vector<uint8_t> & data, std::mt19937 & random, const size_t chunk) noexcept
+	: m_data(data.data())
+	, m_size(data.size())
+	, m_position(0)
+	, m_random(random)
+	, m_chunk(chunk)
+	{}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		const auto len = std::min({amount, m_size - m_position, 1 + m_random() % m_chunk});
+		memcpy(buffer, m_data + m_position, len);
+		m_position += len;
+		return len;
+	}
+};
+
+// Keeps the one bitmap extract_entry() hands it.
+struct capture final : container {
+	std::vector<uint8_t> & m_output;
+
+	inline explicit capture(std::vector<uint8_t> & output) noexcept
+	: m_output(output)
+	{}
+
+	void add(const std::string &, const void * data, const size_t size) override {
+		const auto bytes = static_cast<const uint8_t *>(data);
+		m_output.assign(bytes, bytes + size);
+	}
+
+	void add(const std::string &, size_t, const std::function<void(obufstream &)> &) override {
+		throw error("no memory budget was given");
+	}
+
+	void finish() override {
+	}
+};
+
+// Counts what is left of stream.
+size_t remaining(ibufstream & stream) {
+	size_t result = 0;
+	for (const uint8_t * block; const auto len = stream.peek(block);) {
+		result += len;
+		stream.consume(len);
+	}
+	return result;
+}
+
+// Collects what an archive_parser finds in its one entry.
+struct collector final : archive_handler {
+	std::vector<uint8_t> & m_output;
+
+	inline explicit collector(std::vector<uint8_t> & output) noexcept
+	: m_output(output)
+	{}
+
+	void entry_data(size_t, const void * data, const size_t size) override {
+		const auto bytes = static_cast<const uint8_t *>(data);
+		m_output.insert(m_output.end(), bytes, bytes + size);
+	}
+};
+
+// Wraps the case up as an archive with it as its first entry, followed by
+// a plain entry holding trailer unless that is empty.
+std::vector<uint8_t> make_archive(const fuzz_case & c, const std::vector<uint8_t> & trailer = {}) {
+	std::vector<uint8_t> result;
+	const auto put32 = [&result](const uint32_t value) {
+		for (unsigned i = 0; i < 4; ++i) {
+			result.push_back(uint8_t(value >> (i * 8)));
+		}
+	};
+	const uint32_t count = trailer.empty() ? 1 : 2;
+	const uint32_t first = 1 + 8 + 4 + 4 * count;
+	result.push_back(8);
+	result.insert(result.end(), {'L', 'M', 'D', 'B', 'M', 'L', '3', '0'});
+	put32(count);
+	put32(first);
+	if (!trailer.empty()) {
+		put32(uint32_t(first + 1 + 4 + 4 + 1 + c.input.size()));
+	}
+	result.push_back(9);
+	put32(uint32_t(c.size));
+	put32(uint32_t(c.input.size()));
+	result.push_back(0);
+	result.insert(result.end(), c.input.begin(), c.input.end());
+	if (!trailer.empty()) {
+		result.push_back(8);
+		put32(uint32_t(trailer.size()));
+		result.insert(result.end(), trailer.begin(), trailer.end());
+	}
+	return result;
+}
+
+// What one decoder made of a case: the bytes it handed over before it
+// stopped, whether it produced the whole bitmap and, where that can be
+// seen, how much input it read.
+struct outcome {
+	static constexpr size_t unknown = SIZE_MAX;
+
+	std::vector<uint8_t> output;
+	bool complete;
+	size_t consumed = unknown;
+	// Whether output holds what was produced even when complete is false.
+	bool partial = true;
+};
+
+constexpr size_t outcome::unknown;
+
+struct decoder_path {
+	const char * name;
+	size_t bytes;
+	double seconds;
+};
+
+struct fuzzer {
+	const fuzz_options & m_options;
+	std::mt19937 m_random;
+	std::vector<decoder_path> m_paths;
+	size_t m_cases;
+	// What the watchdog looks at: the case being run, bumped as each one
+	// is done, and the decoder it is in.
+	std::atomic<const fuzz_case *> m_current;
+	std::atomic<size_t> m_progress;
+	std::atomic<const char *> m_path;
+
+	inline explicit fuzzer(const fuzz_options & options)
+	: m_options(options)
+	, m_random(options.seed)
+	, m_paths{
+		{"reference", 0, 0},
+		{"ilzrwstream", 0, 0},
+		{"ilzrwstream_chunked", 0, 0},
+		{"archive_decode", 0, 0},
+		{"archive_decode_slice", 0, 0},
+		{"archive_parser", 0, 0},
+		{"extract_entry", 0, 0},
+		{"archive_open_entry", 0, 0},
+	}
+	, m_cases(0)
+	, m_current(nullptr)
+	, m_progress(0)
+	, m_path(nullptr)
+	{}
+
+	// Saves c where the failure option says, as an archive that can be
+	// given back to the fuzzer to run it again.
+	void save(const fuzz_case & c) const {
+		const auto data = make_archive(c);
+		const auto output = ofstream::create(m_options.failure);
+		output->write(data.data(), data.size());
+	}
+
+	template<typename F>
+	outcome run(const size_t path, const fuzz_case & c, F decode) {
+		m_path = m_paths[path].name;
+		outcome result;
+		result.output.reserve(c.size);
+		const auto start = std::chrono::steady_clock::now();
+		try {
+			result.complete = decode(result);
+		} catch (const std::exception &) {
+			result.complete = false;
+		}
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		m_paths[path].bytes += result.output.size();
+		m_paths[path].seconds += elapsed.count();
+		return result;
+	}
+
+	// Reads stream up to most bytes at a time, or as much as is left when
+	// most is 0, until it runs dry.  What was read before a failure is kept.
+	bool drain(istream & stream, std::vector<uint8_t> & output, const size_t size, const size_t most) {
+		output.resize(size);
+		size_t done = 0;
+		try {
+			while (done < size) {
+				const auto amount = most > 0 ? std::min<size_t>(size - done, 1 + m_random() % most) : size - done;
+				const auto len = stream.try_read(output.data() + done, amount);
+				if (len == 0) {
+					break;
+				}
+				done += len;
+			}
+		} catch (...) {
+			output.resize(done);
+			throw;
+		}
+		output.resize(done);
+		return done == size;
+	}
+
+	// Fills size bytes at data with what differs from every byte the
+	// reference produced from offset on, so that a decoder that reports a
+	// failure can still be checked for having written all of those.
+	static void fill_unlike(uint8_t * data, const size_t size, const outcome & reference, const size_t offset) {
+		for (size_t i = 0; i < size; ++i) {
+			data[i] = offset + i < reference.output.size() ? uint8_t(~reference.output[offset + i]) : 0;
+		}
+	}
+
+	// Runs c through every decoder and fails unless each one produces what
+	// the reference does and stops where it stops, having read as much.
+	bool check(const fuzz_case & c) {
+		m_current = &c;
+		// The entry is followed by another whose bytes it must not read.
+		std::vector<uint8_t> trailer(1 + m_random() % 256);
+		for (auto & byte : trailer) {
+			byte = uint8_t(m_random());
+		}
+		const auto archive_data = make_archive(c, trailer);
+		const auto reference = run(0, c, [&c](outcome & result) {
+			auto & output = result.output;
+			output.resize(c.size);
+			output.resize(reference_decode(c.input.data(), c.input.size(), output.data(), c.size, result.consumed));
+			return output.size() == c.size;
+		});
+		std::vector<outcome> outcomes;
+		outcomes.push_back(run(1, c, [this, &c](outcome & result) {
+			const auto view = ibufstream::view(c.input.data(), c.input.size());
+			const auto complete = drain(*ilzrwstream::wrap(*view), result.output, c.size, 0);
+			result.consumed = c.input.size() - remaining(*view);
+			return complete;
+		}));
+		outcomes.push_back(run(2, c, [this, &c](outcome & result) {
+			chunked_istream input(c.input, m_random, 1 + m_random() % 64);
+			const auto buffer = ibufstream::wrap(input, 1 + m_random() % 256);
+			const auto complete = drain(*ilzrwstream::wrap(*buffer), result.output, c.size, 1 + m_random() % 512);
+			result.consumed = c.input.size() - remaining(*buffer);
+			return complete;
+		}));
+		outcomes.push_back(run(3, c, [&c, &archive_data, &reference](outcome & result) {
+			const auto view = ibufstream::view(archive_data.data(), archive_data.size());
+			auto & output = result.output;
+			output.resize(c.size);
+			fill_unlike(output.data(), output.size(), reference, 0);
+			try {
+				archive::wrap(*view)->decode(0, output.data(), c.size);
+			} catch (...) {
+				// All that the reference produced must be there.
+				output.resize(reference.output.size());
+				throw;
+			}
+			return true;
+		}));
+		outcomes.push_back(run(4, c, [this, &c, &archive_data, &reference](outcome & result) {
+			const auto view = ibufstream::view(archive_data.data(), archive_data.size());
+			const auto archive = archive::wrap(*view);
+			auto & output = result.output;
+			lzrw_state state{};
+			std::vector<uint8_t> slice;
+			const auto most = 1 + m_random() % std::max<size_t>(c.size / 4, 16);
+			while (true) {
+				slice.resize(1 + m_random() % most);
+				fill_unlike(slice.data(), slice.size(), reference, output.size());
+				size_t len;
+				try {
+					len = archive->decode_slice(0, state, slice.data(), slice.size());
+				} catch (...) {
+					const auto left = reference.output.size() - std::min(output.size(), reference.output.size());
+					output.insert(output.end(), slice.begin(), slice.begin() + std::min(left, slice.size()));
+					throw;
+				}
+				if (len == 0) {
+					break;
+				}
+				output.insert(output.end(), slice.begin(), slice.begin() + len);
+			}
+			result.consumed = state.input;
+			return output.size() == c.size;
+		}));
+		outcomes.push_back(run(5, c, [this, &c, &archive_data](outcome & result) {
+			collector handler(result.output);
+			const auto parser = archive_parser::create(handler, {entry_range{0, 0}});
+			const auto most = 1 + m_random() % 1024;
+			for (size_t done = 0; done < archive_data.size();) {
+				const auto len = std::min<size_t>(archive_data.size() - done, 1 + m_random() % most);
+				parser->feed(archive_data.data() + done, len);
+				done += len;
+			}
+			parser->finish();
+			return result.output.size() == c.size;
+		}));
+		outcomes.push_back(run(6, c, [&c, &archive_data](outcome & result) {
+			const auto view = ibufstream::view(archive_data.data(), archive_data.size());
+			const auto archive = archive::wrap(*view);
+			result.partial = false;
+			capture output(result.output);
+			extract_options options;
+			options.output = &output;
+			bitmap_names names("fuzz.ris");
+			extract_entry(*view, names, 0, archive->entry(0).offset, options, archive->entry(1).offset);
+			return result.output.size() == c.size;
+		}));
+		outcomes.push_back(run(7, c, [this, &c, &archive_data](outcome & result) {
+			const auto view = ibufstream::view(archive_data.data(), archive_data.size());
+			const auto entry = archive::wrap(*view)->open_entry(0);
+			return drain(*entry, result.output, c.size, 1 + m_random() % 512);
+		}));
+
+		if (!c.original.empty() && (!reference.complete || reference.output != c.original)) {
+			fprintf(stderr, "%s case: the reference does not give back what was compressed\n", c.kind);
+			return false;
+		}
+		for (size_t i = 0; i < outcomes.size(); ++i) {
+			const auto & result = outcomes[i];
+			const auto & name = m_paths[i + 1].name;
+			if (result.complete != reference.complete) {
+				fprintf(stderr, "%s case: %s %s where the reference %s\n", c.kind, name,
+					result.complete ? "finished" : "stopped", reference.complete ? "finished" : "stopped");
+				return false;
+			} else if (!result.complete && !result.partial) {
+				continue;
+			} else if (result.output.size() != reference.output.size()) {
+				fprintf(stderr, "%s case: %s produced %zu bytes, the reference %zu\n", c.kind, name,
+					result.output.size(), reference.output.size());
+				return false;
+			} else if (result.output != reference.output) {
+				fprintf(stderr, "%s case: %s differs from the reference\n", c.kind, name);
+				return false;
+			} else if (result.consumed != outcome::unknown && result.consumed != reference.consumed) {
+				fprintf(stderr, "%s case: %s read %zu bytes, the reference %zu\n", c.kind, name,
+					result.consumed, reference.consumed);
+				return false;
+			}
+		}
+		++m_cases;
+		++m_progress;
+		return true;
+	}
+
+	// Makes bytes that repeat runs from the 4K before them, as bench does.
+	void generate_data(std::vector<uint8_t> & data, const size_t size) {
+		data.clear();
+		const auto compressibility = std::uniform_real_distribution<double>(0, 1)(m_random);
+		const unsigned alphabet = 1 + m_random() % 256;
+		while (data.size() < size) {
+			const auto left = size - data.size();
+			if (data.size() > 0 && left >= 3 && std::uniform_real_distribution<double>(0, 1)(m_random) < compressibility) {
+				const auto distance = 1 + m_random() % std::min<size_t>(data.size(), 4096);
+				const auto len = 3 + m_random() % (std::min<size_t>(left, 16) - 2);
+				for (size_t i = 0; i < len; ++i) {
+					data.push_back(data[data.size() - distance]);
+				}
+			} else {
+				data.push_back(uint8_t(m_random() % alphabet));
+			}
+		}
+	}
+
+	// Random control words and tokens, with matches near and far and
+	// reaching back before the start, cut short now and then.
+	void generate_tokens(fuzz_case & c, const size_t size) {
+		c.kind = "tokens";
+		c.input.clear();
+		c.original.clear();
+		const auto density = m_random() % 17;
+		size_t produced = 0;
+		while (produced < size) {
+			unsigned control = 0;
+			for (unsigned bit = 0; bit < 16; ++bit) {
+				if (m_random() % 16 < density) {
+					control |= 1u << bit;
+				}
+			}
+			c.input.push_back(uint8_t(control));
+			c.input.push_back(uint8_t(control >> 8));
+			for (unsigned bit = 0; bit < 16; ++bit) {
+				if (control & (1u << bit)) {
+					size_t distance;
+					switch (m_random() % 3) {
+					case 0:
+						distance = 1 + m_random() % 16;
+						break;
+					case 1:
+						distance = 1 + m_random() % std::max<size_t>(produced, 1);
+						break;
+					default:
+						distance = 1 + m_random() % 4096;
+						break;
+					}
+					const auto len = 1 + m_random() % 16;
+					const auto ofs = distance % 4096;
+					c.input.push_back(uint8_t(ofs & 0xff));
+					c.input.push_back(uint8_t(((ofs >> 4) & 0xf0) | (len - 1)));
+					produced += len;
+				} else {
+					c.input.push_back(uint8_t(m_random()));
+					produced += 1;
+				}
+			}
+		}
+		switch (m_random() % 4) {
+		case 0:
+			c.size = 1 + m_random() % produced;
+			break;
+		case 1:
+			c.size = produced + 1 + m_random() % 64;
+			break;
+		default:
+			c.size = produced;
+			break;
+		}
+		if (m_random() % 8 == 0) {
+			c.input.resize(m_random() % c.input.size());
+		}
+	}
+
+	void generate_compressed(fuzz_case & c, const size_t size) {
+		c.kind = "compressed";
+		generate_data(c.original, size);
+		c.input.clear();
+		lzrw_compress(c.original.data(), c.original.size(), c.input);
+		c.size = c.original.size();
+	}
+
+	// Compressed data with bytes changed, dropped, added or cut off.
+	void generate_mutated(fuzz_case & c, const size_t size) {
+		generate_compressed(c, size);
+		c.kind = "mutated";
+		c.original.clear();
+		for (auto edits = 1 + m_random() % 8; edits > 0 && !c.input.empty(); --edits) {
+			const auto at = m_random() % c.input.size();
+			switch (m_random() % 4) {
+			case 0:
+				c.input[at] ^= uint8_t(1u << (m_random() % 8));
+				break;
+			case 1:
+				c.input.erase(c.input.begin() + at);
+				break;
+			case 2:
+				c.input.insert(c.input.begin() + at, uint8_t(m_random()));
+				break;
+			default:
+				c.input.resize(at);
+				break;
+			}
+		}
+		if (m_random() % 4 == 0) {
+			c.size += m_random() % 64;
+		}
+	}
+
+	void generate_noise(fuzz_case & c, const size_t size) {
+		c.kind = "noise";
+		c.original.clear();
+		c.input.resize(m_random() % size);
+		for (auto & byte : c.input) {
+			byte = uint8_t(m_random());
+		}
+		c.size = 1 + m_random() % size;
+	}
+
+	bool run_random() {
+		fuzz_case c;
+		for (size_t i = 0; i < m_options.cases; ++i) {
+			const auto size = 1 + m_random() % m_options.size;
+			switch (i % 4) {
+			case 0:
+				generate_tokens(c, size);
+				break;
+			case 1:
+				generate_compressed(c, size);
+				break;
+			case 2:
+				generate_mutated(c, size);
+				break;
+			default:
+				generate_noise(c, size);
+				break;
+			}
+			if (!check(c)) {
+				fprintf(stderr, "case %zu of seed %u failed and was saved to %s\n", i, m_options.seed, m_options.failure.c_str());
+				save(c);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Checks every compressed entry of an archive, taking its payload to be
+	// size2 bytes long, or to run to the end of the file where it cannot be.
+	bool run_archive(const std::string & filename) {
+		const auto stream = ibufstream::open(filename);
+		std::vector<uint8_t> data;
+		for (const uint8_t * block; const auto len = stream->peek(block);) {
+			data.insert(data.end(), block, block + len);
+			stream->consume(len);
+		}
+		const auto view = ibufstream::view(data.data(), data.size());
+		const auto archive = archive::wrap(*view);
+		fuzz_case c;
+		c.kind = "archive";
+		for (size_t i = 0; i < archive->size(); ++i) {
+			const auto entry = archive->entry(i);
+			const size_t begin = size_t(entry.offset) + 1 + 4 + 4 + 1;
+			if (entry.type != 9 || entry.size1 == 0 || begin > data.size()) {
+				continue;
+			}
+			const auto left = data.size() - begin;
+			const auto len = entry.size2 > 0 && entry.size2 <= left ? entry.size2 : left;
+			c.input.assign(data.begin() + begin, data.begin() + begin + len);
+			c.size = entry.size1;
+			if (!check(c)) {
+				fprintf(stderr, "entry %zu of %s failed and was saved to %s\n", i, filename.c_str(), m_options.failure.c_str());
+				save(c);
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// Ends the process when a case makes no progress for the timeout, which
+// with inputs this small can only be a decoder stuck in a loop.
+struct watchdog {
+	fuzzer & m_fuzzer;
+	std::mutex m_mutex;
+	std::condition_variable m_stopped;
+	bool m_stop;
+	std::thread m_thread;
+
+	inline explicit watchdog(fuzzer & fuzzer)
+	: m_fuzzer(fuzzer)
+	, m_stop(false)
+	, m_thread(&watchdog::watch, this)
+	{}
+
+	~watchdog() noexcept {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_stopped.notify_one();
+		m_thread.join();
+	}
+
+	void watch() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto seen = m_fuzzer.m_progress.load();
+		auto since = std::chrono::steady_clock::now();
+		while (!m_stopped.wait_for(lock, std::chrono::milliseconds(100), [this] { return m_stop; })) {
+			const auto now = std::chrono::steady_clock::now();
+			const auto progress = m_fuzzer.m_progress.load();
+			if (progress != seen) {
+				seen = progress;
+				since = now;
+			} else if (now - since >= std::chrono::seconds(m_fuzzer.m_options.timeout)) {
+				const auto path = m_fuzzer.m_path.load();
+				const auto c = m_fuzzer.m_current.load();
+				fprintf(stderr, "%s case: %s made no progress in %u seconds; saved to %s\n",
+					c ? c->kind : "no", path ? path : "nothing", m_fuzzer.m_options.timeout, m_fuzzer.m_options.failure.c_str());
+				if (c) {
+					try {
+						m_fuzzer.save(*c);
+					} catch (const std::exception & e) {
+						fprintf(stderr, "%s\n", e.what());
+					}
+				}
+				_exit(2);
+			}
+		}
+	}
+};
+
+void print_json(FILE * out, const fuzz_options & options, const fuzzer & fuzzer) {
+	fprintf(out, "{\n");
+	fprintf(out, "\t\"cases\": %zu, \"seed\": %u,\n", fuzzer.m_cases, options.seed);
+	fprintf(out, "\t\"results\": [\n");
+	for (size_t i = 0; i < fuzzer.m_paths.size(); ++i) {
+		const auto & path = fuzzer.m_paths[i];
+		fprintf(out, "\t\t{\"name\": \"%s\", \"bytes\": %zu, \"seconds\": %.6f, \"mib_per_second\": %.1f}%s\n",
+			path.name, path.bytes, path.seconds, path.seconds > 0 ? path.bytes / path.seconds / (1024 * 1024) : 0.0,
+			i + 1 < fuzzer.m_paths.size() ? "," : "");
+	}
+	fprintf(out, "\t]\n}\n");
+}
+
+size_t parse_size(const char * text) {
+	char * end;
+	errno = 0;
+	const auto value = strtoull(text, &end, 10);
+	if (errno != 0 || end == text || *end != '\0') {
+		throw error("invalid number: %s", text);
+	} else {
+		return value;
+	}
+}
+
+int main(int argc, char ** argv) {
+	fuzz_options options;
+	for (int opt; (opt = getopt(argc, argv, "n:s:S:t:o:")) != -1;) {
+		switch (opt) {
+		case 'n':
+			options.cases = parse_size(optarg);
+			break;
+		case 's':
+			options.size = std::max<size_t>(parse_size(optarg), 1);
+			break;
+		case 'S':
+			options.seed = unsigned(parse_size(optarg));
+			break;
+		case 't':
+			options.timeout = unsigned(std::max<size_t>(parse_size(optarg), 1));
+			break;
+		case 'o':
+			options.failure = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n cases] [-s size] [-S seed] [-t timeout] [-o failure] [file.ris...]\n", argv[0]);
+			return 1;
+		}
+	}
+	for (int i = optind; i < argc; ++i) {
+		options.archives.push_back(argv[i]);
+	}
+
+	fuzzer fuzzer(options);
+	bool passed;
+	{
+		watchdog watchdog(fuzzer);
+		passed = fuzzer.run_random();
+		for (size_t i = 0; passed && i < options.archives.size(); ++i) {
+			passed = fuzzer.run_archive(options.archives[i]);
+		}
+	}
+	print_json(stdout, options, fuzzer);
+	return passed ? 0 : 1;
+}
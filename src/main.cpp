@@ -1,347 +1,364 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
 #include <cstdint>
 #include <string>
-#include <cstring>
-#include <stdexcept>
-#include <cstdio>
-#include <cstdarg>
 #include <vector>
-#include <memory>
-#include <array>
+#include <thread>
+#include <algorithm>
 #include <system_error>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 #include <unistd.h>
-
-struct end_of_stream : std::exception {
-	const char * what() const noexcept { return "end of stream"; }
-};
-
-struct istream {
-	inline virtual ~istream() noexcept = default;
-	virtual size_t try_read(void * buffer, size_t amount) = 0;
-	void read(void * buffer, size_t amount);
-	template<typename T> void read(T & value);
-	template<typename T> T read();
-};
-
-void istream::read(void * buffer, const size_t amount) {
-	for (size_t remaining = amount; remaining > 0;) {
-		const auto offset = amount - remaining;
-		const auto dst = static_cast<char *>(buffer) + offset;
-		const auto result = try_read(dst, remaining);
-		if (result > 0) {
-			remaining -= result;
-		} else {
-			throw end_of_stream{};
-		}
+#include <getopt.h>
+#include <risconvert.h>
+
+void read_filenames(const char * list_filename, std::vector<std::string> & filenames) {
+	const auto from_stdin = strcmp(list_filename, "-") == 0;
+	const auto list = from_stdin ? stdin : fopen(list_filename, "r");
+	if (list == nullptr) {
+		throw std::system_error(errno, std::system_category());
 	}
-}
-
-template<typename T>
-inline void istream::read(T & value) {
-	read(&value, sizeof(T));
-}
-
-template<typename T>
-inline T istream::read() {
-	T tmp;
-	read(&tmp, sizeof(T));
-	return tmp;
-}
-
-struct ostream {
-	inline virtual ~ostream() noexcept = default;
-	virtual size_t try_write(const void * buffer, size_t amount) = 0;
-	void write(const void * buffer, size_t amount);
-	template<typename T> void write(const T & value);
-};
-
-void ostream::write(const void * buffer, size_t amount) {
-	for (size_t remaining = amount; remaining > 0;) {
-		const auto offset = amount - remaining;
-		const auto src = static_cast<const char *>(buffer) + offset;
-		const auto result = try_write(src, remaining);
-		if (result > 0) {
-			remaining -= result;
-		} else {
-			throw end_of_stream{};
+	char * line = nullptr;
+	size_t capacity = 0;
+	for (ssize_t len; (len = getline(&line, &capacity, list)) >= 0;) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
 		}
-	}
-}
-
-template<typename T>
-inline void ostream::write(const T & value) {
-	write(&value, sizeof(T));
-}
-
-struct iostream : istream, ostream {
-	inline virtual ~iostream() noexcept = default;
-};
-
-struct ifstream : istream {
-	inline virtual ~ifstream() noexcept = default;
-	static std::unique_ptr<ifstream> open(const std::string & filename);
-	virtual void seek(size_t offset) = 0;
-};
-
-struct ifstream_impl final : ifstream {
-	int m_fd;
-
-	inline ifstream_impl(const std::string & filename)
-       	: m_fd(::open(filename.c_str(), O_RDONLY | O_CLOEXEC)) {
-		if (m_fd < 0) {
-			throw std::system_error(errno, std::system_category());
+		if (len > 0) {
+			filenames.emplace_back(line, len);
 		}
 	}
-
-	~ifstream_impl() noexcept {
-		::close(m_fd);
+	free(line);
+	if (!from_stdin) {
+		fclose(list);
 	}
+}
 
-	size_t try_read(void * buffer, const size_t amount) override {
-		if (amount > 0) {
-			const auto result = ::read(m_fd, buffer, amount);
-			if (result >= 0) {
-				return result;
-			} else {
-				throw std::system_error(errno, std::system_category());
-			}
-		} else {
-			return 0;
-		}
+size_t parse_jobs(const char * text) {
+	char * end;
+	errno = 0;
+	const auto value = strtoul(text, &end, 10);
+	if (errno != 0 || end == text || *end != '\0') {
+		throw error("invalid job count: %s", text);
+	} else if (value == 0) {
+		return std::max(1u, std::thread::hardware_concurrency());
+	} else {
+		return value;
 	}
+}
 
-	void seek(const size_t offset) override {
-		if (::lseek(m_fd, offset, SEEK_SET) >= 0) {
-			return;
-		} else {
-			throw std::system_error(errno, std::system_category());
-		}
+// Accepts a plain number of things, which must be at least one.
+size_t parse_count(const char * text) {
+	char * end;
+	errno = 0;
+	const auto value = strtoul(text, &end, 10);
+	if (errno != 0 || end == text || *end != '\0' || *text == '-' || *text == '+' || value == 0) {
+		throw error("invalid count: %s", text);
+	} else {
+		return value;
 	}
-};
-
-std::unique_ptr<ifstream> ifstream::open(const std::string & filename) {
-	return std::unique_ptr<ifstream>(new ifstream_impl(filename));
 }
 
-struct ofstream : iostream {
-	inline virtual ~ofstream() noexcept = default;
-	static std::unique_ptr<ofstream> create(const std::string & filename);
-	virtual void seek(size_t offset) = 0;
-};
-
-struct ofstream_impl final : ofstream {
-	int m_fd;
-
-	inline ofstream_impl(const std::string & filename)
-       	: m_fd(::open(filename.c_str(), O_RDWR | O_TRUNC | O_CREAT | O_CLOEXEC)) {
-		if (m_fd < 0) {
-			throw std::system_error(errno, std::system_category());
-		}
+// Accepts a byte count with an optional K, M or G suffix.
+size_t parse_size(const char * text) {
+	char * end;
+	errno = 0;
+	auto value = strtoull(text, &end, 10);
+	const auto digits = end != text && *text != '-' && *text != '+';
+	unsigned shift = 0;
+	if (*end == 'K' || *end == 'k') {
+		shift = 10;
+	} else if (*end == 'M' || *end == 'm') {
+		shift = 20;
+	} else if (*end == 'G' || *end == 'g') {
+		shift = 30;
 	}
-
-	~ofstream_impl() noexcept {
-		::close(m_fd);
+	if (shift != 0) {
+		++end;
 	}
-
-	size_t try_read(void * buffer, const size_t amount) override {
-		if (amount > 0) {
-			const auto result = ::read(m_fd, buffer, amount);
-			if (result >= 0) {
-				return result;
-			} else {
-				throw std::system_error(errno, std::system_category());
-			}
-		} else {
-			return 0;
-		}
-	}
-
-	size_t try_write(const void * buffer, const size_t amount) override {
-		if (amount > 0) {
-			const auto result = ::write(m_fd, buffer, amount);
-			if (result >= 0) {
-				return result;
-			} else {
-				throw std::system_error(errno, std::system_category());
-			}
-		} else {
-			return 0;
-		}
+	if (errno != 0 || !digits || *end != '\0' || value == 0 || value > (SIZE_MAX >> shift)) {
+		throw error("invalid size: %s", text);
 	}
+	return size_t(value) << shift;
+}
 
-	void seek(const size_t offset) override {
-		if (::lseek(m_fd, offset, SEEK_SET) >= 0) {
-			return;
-		} else {
-			throw std::system_error(errno, std::system_category());
-		}
+// Parses an entry number from the start of text and leaves end just past it.
+size_t parse_entry(const char * text, const char *& end) {
+	char * stop;
+	errno = 0;
+	const auto value = strtoul(text, &stop, 10);
+	if (errno != 0 || stop == text || *text == '-' || *text == '+') {
+		throw error("invalid entry: %s", text);
 	}
-};
-
-std::unique_ptr<ofstream> ofstream::create(const std::string & filename) {
-	return std::unique_ptr<ofstream>(new ofstream_impl(filename));
+	end = stop;
+	return value;
 }
 
-struct ilzrwstream : istream {
-	inline virtual ~ilzrwstream() noexcept = default;
-	static std::unique_ptr<ilzrwstream> wrap(istream &);
-};
-
-struct ilzrwstream_impl : ilzrwstream {
-	istream & m_stream;
-	uint8_t m_window[4096];
-	uint16_t m_window_index;
-	uint16_t m_control_bits;
-	uint8_t m_control_remaining;
-
-	inline ilzrwstream_impl(istream & stream) noexcept
-	: m_stream(stream)
-	, m_window_index(0)
-	, m_control_bits(0)
-	, m_control_remaining(0)
-	{}
-
-	size_t try_read(void * buffer, size_t amount) override {
-		for (size_t remaining = amount; remaining > 0;) {
-			const auto offset = amount - remaining;
-			const auto dst = static_cast<uint8_t *>(buffer) + offset;
-			if (m_control_remaining == 0) {
-				m_stream.read(m_control_bits);
-				m_control_remaining = 16;
-			}
-			if (m_control_bits & 0x1) {
-				const auto tmp = m_stream.read<uint16_t>();
-				const size_t ofs = ((tmp & 0xf000) >> 4) | (tmp & 0xff);
-				const size_t len = ((tmp & 0xf00) >> 8) + 1;
-				for (size_t i = 0; i < len; ++i) {
-					const auto index = ((m_window_index + (sizeof(m_window) - ofs)) % sizeof(m_window)) + i;
-					*dst = m_window[index];
-				}
-			} else {
-				const auto value = m_stream.read<uint8_t>();
-				*dst = value;
-				m_window[m_window_index] = value;
-				m_window_index = (m_window_index + 1) % sizeof(m_window);
-			}
-		}
-		return 0;
+entry_range parse_single_entry(const char * text) {
+	const char * end;
+	const auto entry = parse_entry(text, end);
+	if (*end != '\0') {
+		throw error("invalid entry: %s", text);
 	}
-};
-
-std::unique_ptr<ilzrwstream> ilzrwstream::wrap(istream & stream) {
-	return std::unique_ptr<ilzrwstream>(new ilzrwstream_impl(stream));
+	return entry_range{entry, entry};
 }
 
-std::string derive_output_filename(
-	const std::string & input_filename,
-	size_t index
-) {
-	const auto dot = input_filename.find_last_of('.');
-	if (dot != std::string::npos) {
-		const auto format = "%.*s.%zu.bmp";
-		const auto len = snprintf(nullptr, 0, format, int(dot), input_filename.c_str(), index);
-		std::string output_filename(len, 0);
-		snprintf(&output_filename[0], len + 1, format, int(dot), input_filename.c_str(), index);
-		return output_filename;
+// Accepts "A-B", or "A-" for every entry from A on.
+entry_range parse_range(const char * text) {
+	const char * end;
+	entry_range range;
+	range.first = parse_entry(text, end);
+	if (*end != '-') {
+		throw error("invalid range: %s", text);
+	} else if (end[1] == '\0') {
+		range.last = SIZE_MAX;
 	} else {
-		return std::string{};
+		range.last = parse_entry(end + 1, end);
+		if (*end != '\0' || range.last < range.first) {
+			throw error("invalid range: %s", text);
+		}
 	}
+	return range;
 }
 
-auto error(const char * format, ...) {
-	va_list args;
-
-	va_start(args, format);
-	const auto len = vsnprintf(nullptr, 0, format, args);
-	va_end(args);
-
-	std::vector<char> buffer(len + 1);
-	va_start(args, format);
-	vsnprintf(buffer.data(), buffer.size(), format, args);
-	va_end(args);
-
-	return std::runtime_error(buffer.data());
-}
-
-void export_bitmap(
-	istream & input,
-	const std::string & filename,
-	const size_t amount
-) {
-	auto output = ofstream::create(filename);
-	char buffer[4096];
-	for (size_t remaining = amount; remaining > 0;) {
-		const auto len = std::min(remaining, sizeof(buffer));
-		input.read(buffer, len);
-		output->write(buffer, len);
-		remaining -= len;
+// Accepts "K/N" for shard K, counting from 1, of N; returns K - 1.
+size_t parse_shard(const char * text, size_t & count) {
+	const char * end;
+	const auto shard = parse_entry(text, end);
+	if (*end != '/') {
+		throw error("invalid shard: %s", text);
 	}
+	count = parse_entry(end + 1, end);
+	if (*end != '\0' || shard == 0 || shard > count) {
+		throw error("invalid shard: %s", text);
+	}
+	return shard - 1;
 }
 
-void export_plain_bitmap(
-	istream & stream,
-	const std::string & input_filename,
-	const size_t index
-) {
-	const auto size = stream.read<uint32_t>();
-	const auto output_filename = derive_output_filename(input_filename, index);
-	export_bitmap(stream, output_filename, size);
-}
-
-void export_compressed_bitmap(
-	istream & stream,
-	const std::string & input_filename,
-	const size_t index
-) {
-	const auto size1 = stream.read<uint32_t>();
-	const auto size2 = stream.read<uint32_t>();
-	const auto unknown = stream.read<uint8_t>();
-	const auto output_filename = derive_output_filename(input_filename, index);
-	const auto compressed = ilzrwstream::wrap(stream);
-	export_bitmap(*compressed, output_filename, size1);
-}
-
-bool is_bitmap_list(const std::array<char, 8> & magic) noexcept {
-	return memcmp(&magic, "LMDBML30", sizeof(magic)) == 0;
+void print_stats(FILE * file, const extract_stats & stats, const bool json) {
+	const auto mean_match = stats.matches > 0 ? double(stats.match_bytes) / stats.matches : 0.0;
+	const auto mean_entry = stats.entries > 0 ? double(stats.entry_nanoseconds) / stats.entries : 0.0;
+	if (json) {
+		fprintf(file, "{\"read_calls\": %llu, \"read_bytes\": %llu, \"seek_calls\": %llu, "
+			"\"write_calls\": %llu, \"write_bytes\": %llu, \"copy_calls\": %llu, \"copy_bytes\": %llu, "
+			"\"literals\": %llu, \"matches\": %llu, \"match_bytes\": %llu, \"mean_match_length\": %.3f, "
+			"\"entries\": %llu, \"entry_bytes\": %llu, \"entry_seconds\": %.6f, "
+			"\"mean_entry_seconds\": %.9f, \"max_entry_seconds\": %.9f}\n",
+			(unsigned long long) stats.read_calls, (unsigned long long) stats.read_bytes,
+			(unsigned long long) stats.seek_calls,
+			(unsigned long long) stats.write_calls, (unsigned long long) stats.write_bytes,
+			(unsigned long long) stats.copy_calls, (unsigned long long) stats.copy_bytes,
+			(unsigned long long) stats.literals, (unsigned long long) stats.matches,
+			(unsigned long long) stats.match_bytes, mean_match,
+			(unsigned long long) stats.entries, (unsigned long long) stats.entry_bytes,
+			stats.entry_nanoseconds / 1e9, mean_entry / 1e9, stats.max_entry_nanoseconds / 1e9);
+	} else {
+		fprintf(file, "reads:    %llu calls, %llu bytes, %llu seeks\n",
+			(unsigned long long) stats.read_calls, (unsigned long long) stats.read_bytes,
+			(unsigned long long) stats.seek_calls);
+		fprintf(file, "writes:   %llu calls, %llu bytes\n",
+			(unsigned long long) stats.write_calls, (unsigned long long) stats.write_bytes);
+		fprintf(file, "copies:   %llu calls, %llu bytes\n",
+			(unsigned long long) stats.copy_calls, (unsigned long long) stats.copy_bytes);
+		fprintf(file, "decoder:  %llu literals, %llu matches of %.2f bytes on average\n",
+			(unsigned long long) stats.literals, (unsigned long long) stats.matches, mean_match);
+		fprintf(file, "entries:  %llu, %llu bytes, %.3f s in total, %.3f ms on average, %.3f ms at most\n",
+			(unsigned long long) stats.entries, (unsigned long long) stats.entry_bytes,
+			stats.entry_nanoseconds / 1e9, mean_entry / 1e6, stats.max_entry_nanoseconds / 1e6);
+	}
 }
 
-void extract(const std::string & input_filename) {
-	puts(input_filename.c_str());
-	auto stream = ifstream::open(input_filename);
-	const auto version = stream->read<uint8_t>();
-	if (version == 8) {
-		const auto magic = stream->read<std::array<char,8>>();
-		if (is_bitmap_list(magic)) {
-			const auto count = stream->read<uint32_t>();
-			std::vector<uint32_t> offsets(count);
-			for (size_t i = 0; i < count; ++i) {
-				offsets[i] = stream->read<uint32_t>();
+int main(int argc, char ** argv) {
+	try {
+		size_t jobs = 1;
+		extract_options options;
+		std::vector<std::string> input_filenames;
+		std::unique_ptr<container> output;
+		std::unique_ptr<image_encoder> encoder;
+		std::unique_ptr<memory_budget> memory;
+		const char * pack_filename = nullptr;
+		bool compress = true;
+		const char * socket_path = nullptr;
+		size_t max_open = 64;
+		size_t header_memory = 16 << 20;
+		size_t cache_memory = 256 << 20;
+		const char * plan_filename = nullptr;
+		const char * manifest_filename = nullptr;
+		size_t shard = 0;
+		size_t shards = 1;
+		const char * format = "bmp";
+		size_t encode_jobs = 0;
+		extract_stats stats;
+		bool json_stats = false;
+		const option long_options[] = {
+			{"entry", required_argument, nullptr, 'e'},
+			{"range", required_argument, nullptr, 'r'},
+			{"index", no_argument, nullptr, 'x'},
+			{"output", required_argument, nullptr, 'o'},
+			{"cache", required_argument, nullptr, 'C'},
+			{"stats", optional_argument, nullptr, 'S'},
+			{"verify", no_argument, nullptr, 'V'},
+			{"format", required_argument, nullptr, 'F'},
+			{"encode-jobs", required_argument, nullptr, 'E'},
+			{"max-memory", required_argument, nullptr, 'M'},
+			{"pack", required_argument, nullptr, 'P'},
+			{"store", no_argument, nullptr, 'T'},
+			{"serve", required_argument, nullptr, 'L'},
+			{"max-open", required_argument, nullptr, 'O'},
+			{"header-memory", required_argument, nullptr, 'H'},
+			{"cache-memory", required_argument, nullptr, 'B'},
+			{"plan", required_argument, nullptr, 'N'},
+			{"manifest", required_argument, nullptr, 'A'},
+			{"shard", required_argument, nullptr, 'D'},
+			{"drop-cache", no_argument, nullptr, 'K'},
+			{nullptr, 0, nullptr, 0},
+		};
+		for (int opt; (opt = getopt_long(argc, argv, "j:f:muqe:r:xo:C:", long_options, nullptr)) != -1;) {
+			switch (opt) {
+			case 'j':
+				jobs = parse_jobs(optarg);
+				break;
+			case 'f':
+				read_filenames(optarg, input_filenames);
+				break;
+			case 'm':
+				options.map_output = true;
+				break;
+			case 'u':
+				options.io_uring = true;
+				break;
+			case 'q':
+				options.quiet = true;
+				break;
+			case 'e':
+				options.entries.push_back(parse_single_entry(optarg));
+				break;
+			case 'r':
+				options.entries.push_back(parse_range(optarg));
+				break;
+			case 'x':
+				options.use_index = true;
+				break;
+			case 'S':
+				if (optarg != nullptr && strcmp(optarg, "json") == 0) {
+					json_stats = true;
+				} else if (optarg != nullptr && strcmp(optarg, "text") != 0) {
+					throw error("invalid stats format: %s", optarg);
+				}
+				options.stats = &stats;
+				break;
+			case 'F':
+				format = optarg;
+				break;
+			case 'E':
+				encode_jobs = parse_jobs(optarg);
+				break;
+			case 'M':
+				memory = memory_budget::create(parse_size(optarg));
+				options.memory = memory.get();
+				break;
+			case 'P':
+				pack_filename = optarg;
+				break;
+			case 'T':
+				compress = false;
+				break;
+			case 'L':
+				socket_path = optarg;
+				break;
+			case 'O':
+				max_open = parse_count(optarg);
+				break;
+			case 'H':
+				header_memory = parse_size(optarg);
+				break;
+			case 'B':
+				cache_memory = parse_size(optarg);
+				break;
+			case 'N':
+				plan_filename = optarg;
+				break;
+			case 'A':
+				manifest_filename = optarg;
+				break;
+			case 'D':
+				shard = parse_shard(optarg, shards);
+				break;
+			case 'K':
+				options.drop_input = true;
+				break;
+			case 'V':
+				options.verify = true;
+				break;
+			case 'C':
+				options.cache_directory = optarg;
+				break;
+			case 'o':
+				output = container::tar(optarg);
+				options.output = output.get();
+				// Keeps the listing of inputs out of the tar stream.
+				options.quiet = options.quiet || strcmp(optarg, "-") == 0;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-q] [-m] [-u] [-x] [-j jobs] [-e entry] [-r first-last] [-o file.tar] [-C cache] [--stats[=json]] [--verify] [--format png] [--encode-jobs n] [--max-memory size] [--drop-cache] [-f list] file.ris...\n"
+					"       %s --pack file.ris [--store] [-j jobs] [-f list] file...\n"
+					"       %s --serve socket [-j jobs] [--max-open n] [--header-memory size] [--cache-memory size]\n"
+					"       %s --plan manifest [-x] [-j jobs] [-f list] file.ris...\n"
+					"       %s --manifest manifest [--shard k/n] [options]\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
+				return 1;
 			}
-
-			for (size_t i = 0; i < count; ++i) {
-				stream->seek(offsets[i]);
-				const auto type = stream->read<uint8_t>();
-				if (type == 8) {
-					export_plain_bitmap(*stream, input_filename, i);
-				} else if (type == 9) {
-					export_compressed_bitmap(*stream, input_filename, i);
-				} else {
-					throw error("unknown type: %u", type);
+		}
+		input_filenames.insert(input_filenames.begin(), argv + optind, argv + argc);
+		if (socket_path != nullptr) {
+			const auto cache = entry_cache::create(header_memory, cache_memory, max_open);
+			serve(socket_path, jobs, *cache);
+			return 0;
+		} else if (pack_filename != nullptr) {
+			pack(pack_filename, input_filenames, jobs, compress);
+			return 0;
+		} else if (plan_filename != nullptr) {
+			std::vector<manifest_archive> manifest;
+			const auto failures = plan_manifest(input_filenames, jobs, options.use_index, manifest);
+			save_manifest(plan_filename, manifest);
+			return failures > 0 ? 1 : 0;
+		} else if (manifest_filename != nullptr) {
+			if (!input_filenames.empty() || !options.entries.empty()) {
+				throw error("--manifest brings its own inputs and entries");
+			}
+			const auto manifest = load_manifest(manifest_filename);
+			auto ranges = shard_manifest(manifest, shard, shards);
+			// Archives with nothing in this shard are not opened at all.
+			for (size_t i = 0; i < manifest.size(); ++i) {
+				if (!ranges[i].empty()) {
+					input_filenames.push_back(manifest[i].filename);
+					options.input_entries.push_back(std::move(ranges[i]));
 				}
 			}
-		} else {
-			puts("Does not contain images");
+		} else if (shards > 1) {
+			throw error("--shard needs --manifest");
 		}
-	} else {
-		throw error("unknown version: %u", version);
-	}
-}
-
-int main(int argc, const char ** argv) {
-	if (argc > 1) {
-		extract(argv[1]);
+		if (strcmp(format, "png") == 0) {
+			if (output) {
+				throw error("--format cannot be combined with -o");
+			}
+			encoder = image_encoder::png(encode_jobs > 0 ? encode_jobs : jobs);
+			options.encoder = encoder.get();
+		} else if (strcmp(format, "bmp") != 0) {
+			throw error("unknown format: %s", format);
+		}
+		auto failures = extract(input_filenames, jobs, options);
+		if (encoder) {
+			failures += encoder->finish();
+		}
+		if (output) {
+			output->finish();
+		}
+		if (options.stats != nullptr) {
+			print_stats(stderr, stats, json_stats);
+		}
+		return failures > 0 ? 1 : 0;
+	} catch (const std::exception & e) {
+		fprintf(stderr, "%s: %s\n", argv[0], e.what());
+		return 1;
 	}
-	return 0;
 }
@@ -0,0 +1,4818 @@
+#include <cstdint>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <vector>
+#include <memory>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <system_error>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <limits>
+#include <iterator>
+#include <ctime>
+#include <chrono>
+#include <list>
+#include <unordered_map>
+#include <queue>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#if defined(RISCONVERT_PNG)
+#include <png.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include <risconvert.h>
+
+extract_stats & extract_stats::local() noexcept {
+	static thread_local extract_stats stats;
+	return stats;
+}
+
+void extract_stats::add(const extract_stats & other) noexcept {
+	read_calls += other.read_calls;
+	read_bytes += other.read_bytes;
+	seek_calls += other.seek_calls;
+	write_calls += other.write_calls;
+	write_bytes += other.write_bytes;
+	copy_calls += other.copy_calls;
+	copy_bytes += other.copy_bytes;
+	literals += other.literals;
+	matches += other.matches;
+	match_bytes += other.match_bytes;
+	entries += other.entries;
+	entry_bytes += other.entry_bytes;
+	entry_nanoseconds += other.entry_nanoseconds;
+	max_entry_nanoseconds = std::max(max_entry_nanoseconds, other.max_entry_nanoseconds);
+}
+
+void istream::read(void * buffer, const size_t amount) {
+	for (size_t remaining = amount; remaining > 0;) {
+		const auto offset = amount - remaining;
+		const auto dst = static_cast<char *>(buffer) + offset;
+		const auto result = try_read(dst, remaining);
+		if (result > 0) {
+			remaining -= result;
+		} else {
+			throw end_of_stream{};
+		}
+	}
+}
+
+void ostream::write(const void * buffer, size_t amount) {
+	for (size_t remaining = amount; remaining > 0;) {
+		const auto offset = amount - remaining;
+		const auto src = static_cast<const char *>(buffer) + offset;
+		const auto result = try_write(src, remaining);
+		if (result > 0) {
+			remaining -= result;
+		} else {
+			throw end_of_stream{};
+		}
+	}
+}
+
+// Passes advice on a range of a file to the kernel.
+void advise_file(const int fd, const size_t offset, const size_t size, const ifstream::advice advice) noexcept {
+	const auto hint = advice == ifstream::advice::will_need ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED;
+	::posix_fadvise(fd, offset, size, hint);
+}
+
+struct ifstream_impl final : ifstream {
+	int m_fd;
+
+	inline ifstream_impl(const std::string & filename)
+       	: m_fd(::open(filename.c_str(), O_RDONLY | O_CLOEXEC)) {
+		if (m_fd < 0) {
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	inline explicit ifstream_impl(const int fd) noexcept
+	: m_fd(fd)
+	{}
+
+	~ifstream_impl() noexcept {
+		::close(m_fd);
+	}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		if (amount > 0) {
+			const auto result = ::read(m_fd, buffer, amount);
+			if (result >= 0) {
+				auto & stats = extract_stats::local();
+				++stats.read_calls;
+				stats.read_bytes += result;
+				return result;
+			} else {
+				throw std::system_error(errno, std::system_category());
+			}
+		} else {
+			return 0;
+		}
+	}
+
+	void seek(const size_t offset) override {
+		++extract_stats::local().seek_calls;
+		if (::lseek(m_fd, offset, SEEK_SET) >= 0) {
+			return;
+		} else {
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	bool locate(int & fd, size_t & offset) noexcept override {
+		const auto result = ::lseek(m_fd, 0, SEEK_CUR);
+		if (result >= 0) {
+			fd = m_fd;
+			offset = result;
+			return true;
+		} else {
+			return false;
+		}
+	}
+
+	void advise(const size_t offset, const size_t size, const advice advice) noexcept override {
+		advise_file(m_fd, offset, size, advice);
+	}
+};
+
+std::unique_ptr<ifstream> ifstream::open(const std::string & filename) {
+	return std::unique_ptr<ifstream>(new ifstream_impl(filename));
+}
+
+constexpr size_t ibufstream::default_block_size;
+
+struct ibufstream_impl final : ibufstream {
+	std::unique_ptr<ifstream> m_file;
+	istream & m_stream;
+	ifstream * m_seekable;
+	std::unique_ptr<uint8_t[]> m_buffer;
+	size_t m_block_size;
+	size_t m_begin;
+	size_t m_end;
+	size_t m_position;
+	bool m_positioned;
+
+	inline ibufstream_impl(istream & stream, ifstream * seekable, const size_t block_size)
+	: m_stream(stream)
+	, m_seekable(seekable)
+	, m_buffer(new uint8_t[block_size])
+	, m_block_size(block_size)
+	, m_begin(0)
+	, m_end(0)
+	, m_position(0)
+	, m_positioned(seekable == nullptr)
+	{}
+
+	inline ibufstream_impl(std::unique_ptr<ifstream> file, const bool seekable, const size_t block_size)
+	: m_file(std::move(file))
+	, m_stream(*m_file)
+	, m_seekable(seekable ? m_file.get() : nullptr)
+	, m_buffer(new uint8_t[block_size])
+	, m_block_size(block_size)
+	, m_begin(0)
+	, m_end(0)
+	, m_position(0)
+	, m_positioned(!seekable)
+	{}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		if (amount == 0) {
+			return 0;
+		} else if (m_begin == m_end) {
+			if (amount >= m_block_size) {
+				// The buffer no longer ends at m_position, so seek() must
+				// not serve anything from it.
+				m_begin = 0;
+				m_end = 0;
+				const auto result = m_stream.try_read(buffer, amount);
+				m_position += result;
+				return result;
+			}
+			m_begin = 0;
+			m_end = m_stream.try_read(m_buffer.get(), m_block_size);
+			m_position += m_end;
+			if (m_end == 0) {
+				return 0;
+			}
+		}
+		const auto len = std::min(amount, m_end - m_begin);
+		memcpy(buffer, m_buffer.get() + m_begin, len);
+		m_begin += len;
+		return len;
+	}
+
+	bool locate(int & fd, size_t & offset) noexcept override {
+		size_t position;
+		if (m_seekable && m_seekable->locate(fd, position)) {
+			offset = position - (m_end - m_begin);
+			return true;
+		} else {
+			return false;
+		}
+	}
+
+	void advise(const size_t offset, const size_t size, const advice advice) noexcept override {
+		if (m_seekable) {
+			m_seekable->advise(offset, size, advice);
+		}
+	}
+
+	size_t peek(const uint8_t *& data) override {
+		if (m_begin == m_end) {
+			m_begin = 0;
+			m_end = m_stream.try_read(m_buffer.get(), m_block_size);
+			m_position += m_end;
+		}
+		data = m_buffer.get() + m_begin;
+		return m_end - m_begin;
+	}
+
+	void consume(const size_t amount) noexcept override {
+		m_begin += amount;
+	}
+
+	void seek(const size_t offset) override {
+		if (m_positioned && offset <= m_position && m_position - offset <= m_end) {
+			m_begin = m_end - (m_position - offset);
+		} else if (m_seekable) {
+			m_seekable->seek(offset);
+			m_begin = 0;
+			m_end = 0;
+			m_position = offset;
+			m_positioned = true;
+		} else if (offset > m_position) {
+			skip(offset);
+		} else {
+			throw std::system_error(ESPIPE, std::system_category());
+		}
+	}
+
+	// Reads ahead to offset, leaving the block that contains it buffered.
+	void skip(const size_t offset) {
+		while (m_position < offset) {
+			m_begin = 0;
+			m_end = 0;
+			const auto len = m_stream.try_read(m_buffer.get(), m_block_size);
+			if (len == 0) {
+				return;
+			}
+			m_position += len;
+			m_end = len;
+		}
+		m_begin = m_end - (m_position - offset);
+	}
+
+	bool seekable() const noexcept override {
+		return m_seekable != nullptr;
+	}
+};
+
+struct immapstream_impl final : ibufstream {
+	int m_fd;
+	const uint8_t * m_data;
+	size_t m_size;
+	size_t m_position;
+
+	inline immapstream_impl(const int fd, const void * data, const size_t size) noexcept
+	: m_fd(fd)
+	, m_data(static_cast<const uint8_t *>(data))
+	, m_size(size)
+	, m_position(0)
+	{}
+
+	// A descriptor of -1 marks memory that belongs to the caller.
+	~immapstream_impl() noexcept {
+		if (m_fd >= 0) {
+			::munmap(const_cast<uint8_t *>(m_data), m_size);
+			::close(m_fd);
+		}
+	}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		const uint8_t * data;
+		const auto len = std::min(amount, peek(data));
+		memcpy(buffer, data, len);
+		m_position += len;
+		return len;
+	}
+
+	void seek(const size_t offset) override {
+		m_position = offset;
+	}
+
+	bool locate(int & fd, size_t & offset) noexcept override {
+		fd = m_fd;
+		offset = m_position;
+		return m_fd >= 0;
+	}
+
+	// Pages are dropped from the mapping as well as the page cache, which
+	// keeps any page still mapped.  Only whole pages inside the range are
+	// dropped, as the rest may belong to neighbours still to be read.
+	void advise(const size_t offset, const size_t size, const advice advice) noexcept override {
+		static const size_t page_size = ::sysconf(_SC_PAGESIZE);
+		if (m_fd < 0 || offset >= m_size) {
+			return;
+		}
+		const auto end = std::min(m_size, offset + size);
+		if (advice == advice::will_need) {
+			const auto begin = offset / page_size * page_size;
+			::madvise(const_cast<uint8_t *>(m_data) + begin, end - begin, MADV_WILLNEED);
+		} else {
+			const auto begin = (offset + page_size - 1) / page_size * page_size;
+			const auto last = end == m_size ? end : end / page_size * page_size;
+			if (begin < last) {
+				::madvise(const_cast<uint8_t *>(m_data) + begin, last - begin, MADV_DONTNEED);
+				advise_file(m_fd, begin, last - begin, advice);
+			}
+		}
+	}
+
+	size_t peek(const uint8_t *& data) override {
+		if (m_position < m_size) {
+			data = m_data + m_position;
+			return m_size - m_position;
+		} else {
+			data = m_data + m_size;
+			return 0;
+		}
+	}
+
+	void consume(const size_t amount) noexcept override {
+		m_position += amount;
+	}
+
+	bool seekable() const noexcept override {
+		return true;
+	}
+};
+
+// "-" stands for standard input.  Anything that is neither mapped nor
+// seekable, such as a pipe, is read strictly forward.
+std::unique_ptr<ibufstream> ibufstream::open(const std::string & filename, const size_t block_size) {
+	const auto fd = filename == "-"
+		? ::fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0)
+		: ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	struct stat st;
+	if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		const auto data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			return std::unique_ptr<ibufstream>(new immapstream_impl(fd, data, st.st_size));
+		}
+	}
+	const auto seekable = ::lseek(fd, 0, SEEK_CUR) >= 0;
+	std::unique_ptr<ifstream> file(new ifstream_impl(fd));
+	return std::unique_ptr<ibufstream>(new ibufstream_impl(std::move(file), seekable, block_size));
+}
+
+std::unique_ptr<ibufstream> ibufstream::wrap(istream & stream, const size_t block_size) {
+	return std::unique_ptr<ibufstream>(new ibufstream_impl(stream, nullptr, block_size));
+}
+
+std::unique_ptr<ibufstream> ibufstream::wrap(ifstream & stream, const size_t block_size) {
+	return std::unique_ptr<ibufstream>(new ibufstream_impl(stream, &stream, block_size));
+}
+
+std::unique_ptr<ibufstream> ibufstream::view(const void * data, const size_t size) {
+	return std::unique_ptr<ibufstream>(new immapstream_impl(-1, data, size));
+}
+
+// Opens filename to be written from scratch.  A file that shares its inode
+// with another name, as outputs linked from the bitmap cache do, is unlinked
+// first, so that it is replaced rather than rewritten under both names.
+int open_output(const std::string & filename) {
+	struct stat st;
+	if (::lstat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1 && ::unlink(filename.c_str()) != 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	const auto fd = ::open(filename.c_str(), O_RDWR | O_TRUNC | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	return fd;
+}
+
+struct ofstream_impl final : ofstream {
+	int m_fd;
+
+	inline explicit ofstream_impl(const std::string & filename)
+	: m_fd(open_output(filename))
+	{}
+
+	inline explicit ofstream_impl(const int fd) noexcept
+	: m_fd(fd)
+	{}
+
+	~ofstream_impl() noexcept {
+		::close(m_fd);
+	}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		if (amount > 0) {
+			const auto result = ::read(m_fd, buffer, amount);
+			if (result >= 0) {
+				auto & stats = extract_stats::local();
+				++stats.read_calls;
+				stats.read_bytes += result;
+				return result;
+			} else {
+				throw std::system_error(errno, std::system_category());
+			}
+		} else {
+			return 0;
+		}
+	}
+
+	size_t try_write(const void * buffer, const size_t amount) override {
+		if (amount > 0) {
+			const auto result = ::write(m_fd, buffer, amount);
+			if (result >= 0) {
+				auto & stats = extract_stats::local();
+				++stats.write_calls;
+				stats.write_bytes += result;
+				return result;
+			} else {
+				throw std::system_error(errno, std::system_category());
+			}
+		} else {
+			return 0;
+		}
+	}
+
+	void seek(const size_t offset) override {
+		if (::lseek(m_fd, offset, SEEK_SET) >= 0) {
+			return;
+		} else {
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	bool locate(int & fd, size_t & offset) noexcept override {
+		const auto result = ::lseek(m_fd, 0, SEEK_CUR);
+		if (result >= 0) {
+			fd = m_fd;
+			offset = result;
+			return true;
+		} else {
+			return false;
+		}
+	}
+};
+
+std::unique_ptr<ofstream> ofstream::create(const std::string & filename) {
+	return std::unique_ptr<ofstream>(new ofstream_impl(filename));
+}
+
+constexpr size_t obufstream::default_block_size;
+
+// Output blocks of default_block_size that a thread has finished with are
+// kept for its next bitmap instead of going back to the allocator.
+struct block_pool {
+	static std::unique_ptr<uint8_t[]> & cached() noexcept {
+		static thread_local std::unique_ptr<uint8_t[]> block;
+		return block;
+	}
+
+	std::unique_ptr<uint8_t[]> m_block;
+
+	inline block_pool()
+	: m_block(std::move(cached()))
+	{
+		if (!m_block) {
+			m_block.reset(new uint8_t[obufstream::default_block_size]);
+		}
+	}
+
+	~block_pool() noexcept {
+		auto & block = cached();
+		if (!block) {
+			block = std::move(m_block);
+		}
+	}
+
+	uint8_t * data() const noexcept {
+		return m_block.get();
+	}
+};
+
+struct obufstream_impl final : obufstream {
+	std::unique_ptr<ofstream> m_file;
+	ofstream & m_stream;
+	std::unique_ptr<uint8_t[]> m_owned;
+	uint8_t * m_buffer;
+	size_t m_block_size;
+	size_t m_used;
+
+	inline obufstream_impl(ofstream & stream, const size_t block_size)
+	: m_stream(stream)
+	, m_owned(new uint8_t[block_size])
+	, m_buffer(m_owned.get())
+	, m_block_size(block_size)
+	, m_used(0)
+	{}
+
+	inline obufstream_impl(std::unique_ptr<ofstream> file, const size_t block_size)
+	: m_file(std::move(file))
+	, m_stream(*m_file)
+	, m_owned(new uint8_t[block_size])
+	, m_buffer(m_owned.get())
+	, m_block_size(block_size)
+	, m_used(0)
+	{}
+
+	// Buffers through a block the caller owns.
+	inline obufstream_impl(ofstream & stream, block_pool & block)
+	: m_stream(stream)
+	, m_buffer(block.data())
+	, m_block_size(default_block_size)
+	, m_used(0)
+	{}
+
+	~obufstream_impl() noexcept {
+		try {
+			flush();
+		} catch (...) {
+		}
+	}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		flush();
+		return m_stream.try_read(buffer, amount);
+	}
+
+	size_t try_write(const void * buffer, const size_t amount) override {
+		if (m_used == 0 && amount >= m_block_size) {
+			return m_stream.try_write(buffer, amount);
+		}
+		uint8_t * data;
+		const auto len = std::min(amount, reserve(data));
+		memcpy(data, buffer, len);
+		commit(len);
+		return len;
+	}
+
+	void flush() override {
+		if (m_used > 0) {
+			m_stream.write(m_buffer, m_used);
+			m_used = 0;
+		}
+	}
+
+	void seek(const size_t offset) override {
+		flush();
+		m_stream.seek(offset);
+	}
+
+	bool locate(int & fd, size_t & offset) noexcept override {
+		return m_used == 0 && m_stream.locate(fd, offset);
+	}
+
+	size_t reserve(uint8_t *& data) override {
+		if (m_used == m_block_size) {
+			flush();
+		}
+		data = m_buffer + m_used;
+		return m_block_size - m_used;
+	}
+
+	void commit(const size_t amount) noexcept override {
+		m_used += amount;
+	}
+};
+
+struct omapstream_impl final : obufstream {
+	int m_fd;
+	uint8_t * m_data;
+	size_t m_size;
+	size_t m_position;
+	size_t m_length;
+
+	inline omapstream_impl(const int fd, const size_t size)
+	: m_fd(fd)
+	, m_data(nullptr)
+	, m_size(0)
+	, m_position(0)
+	, m_length(0) {
+		try {
+			resize(std::max<size_t>(size, 1));
+		} catch (...) {
+			::close(m_fd);
+			throw;
+		}
+	}
+
+	~omapstream_impl() noexcept {
+		::munmap(m_data, m_size);
+		if (::ftruncate(m_fd, m_length) < 0) {
+			// The destructor cannot report this; the file keeps its reserved size.
+		}
+		::close(m_fd);
+	}
+
+	void resize(const size_t size) {
+		if (::ftruncate(m_fd, size) < 0) {
+			throw std::system_error(errno, std::system_category());
+		}
+		const auto data = m_data == nullptr
+			? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0)
+			: ::mremap(m_data, m_size, size, MREMAP_MAYMOVE);
+		if (data == MAP_FAILED) {
+			throw std::system_error(errno, std::system_category());
+		}
+		m_data = static_cast<uint8_t *>(data);
+		m_size = size;
+	}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		const auto len = m_position < m_length ? std::min(amount, m_length - m_position) : 0;
+		memcpy(buffer, m_data + m_position, len);
+		m_position += len;
+		return len;
+	}
+
+	size_t try_write(const void * buffer, const size_t amount) override {
+		uint8_t * data;
+		const auto len = std::min(amount, reserve(data));
+		memcpy(data, buffer, len);
+		commit(len);
+		return len;
+	}
+
+	void seek(const size_t offset) override {
+		m_position = offset;
+		m_length = std::max(m_length, m_position);
+	}
+
+	bool locate(int & fd, size_t & offset) noexcept override {
+		fd = m_fd;
+		offset = m_position;
+		return m_position < m_size;
+	}
+
+	size_t reserve(uint8_t *& data) override {
+		if (m_position >= m_size) {
+			resize(std::max(m_size * 2, m_position + 1));
+		}
+		data = m_data + m_position;
+		return m_size - m_position;
+	}
+
+	void commit(const size_t amount) noexcept override {
+		m_position += amount;
+		m_length = std::max(m_length, m_position);
+	}
+};
+
+int create_file(const std::string & filename, const size_t size) {
+	const auto fd = open_output(filename);
+	if (size > 0) {
+		// Only a hint, so filesystems without fallocate simply skip it.
+		::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+	}
+	return fd;
+}
+
+std::unique_ptr<obufstream> obufstream::create(const std::string & filename, const size_t size, const size_t block_size) {
+	std::unique_ptr<ofstream> file(new ofstream_impl(create_file(filename, size)));
+	return std::unique_ptr<obufstream>(new obufstream_impl(std::move(file), std::min(block_size, std::max<size_t>(size, 1))));
+}
+
+std::unique_ptr<obufstream> obufstream::map(const std::string & filename, const size_t size) {
+	return std::unique_ptr<obufstream>(new omapstream_impl(create_file(filename, size), size));
+}
+
+std::unique_ptr<obufstream> obufstream::wrap(ofstream & stream, const size_t block_size) {
+	return std::unique_ptr<obufstream>(new obufstream_impl(stream, block_size));
+}
+
+// The part of io_uring used by the asynchronous streams, driven through
+// the raw system calls.  Each thread that uses it gets its own ring.
+struct uring {
+	struct request {
+		inline virtual ~request() noexcept = default;
+		virtual void complete(int result) = 0;
+	};
+
+	int m_fd;
+	void * m_sq_ring;
+	size_t m_sq_ring_size;
+	void * m_cq_ring;
+	size_t m_cq_ring_size;
+	io_uring_sqe * m_sqes;
+	size_t m_sqes_size;
+	unsigned * m_sq_tail;
+	unsigned * m_sq_array;
+	unsigned m_sq_mask;
+	unsigned * m_cq_head;
+	unsigned * m_cq_tail;
+	unsigned m_cq_mask;
+	io_uring_cqe * m_cqes;
+	unsigned m_entries;
+	unsigned m_prepared;
+	unsigned m_in_flight;
+	int m_error;
+	std::vector<std::unique_ptr<uint8_t[]>> m_pool;
+
+	explicit uring(unsigned entries);
+	~uring() noexcept;
+	static uring * local() noexcept;
+	static void drain_local();
+
+	void read(request & request, int fd, void * buffer, size_t amount, size_t offset);
+	void write(request & request, int fd, const void * buffer, size_t amount, size_t offset);
+	void submit();
+	void wait();
+	void drain();
+	void fail(const int error) noexcept {
+		if (m_error == 0) {
+			m_error = error;
+		}
+	}
+	std::unique_ptr<uint8_t[]> acquire();
+	void release(std::unique_ptr<uint8_t[]> buffer);
+
+	io_uring_sqe & prepare(uint8_t opcode, request & request, int fd, size_t offset);
+	void enter(unsigned min_complete);
+	void reap();
+	void unmap() noexcept;
+};
+
+uring::uring(const unsigned entries)
+: m_sq_ring(MAP_FAILED)
+, m_sq_ring_size(0)
+, m_cq_ring(MAP_FAILED)
+, m_cq_ring_size(0)
+, m_sqes(static_cast<io_uring_sqe *>(MAP_FAILED))
+, m_sqes_size(0)
+, m_prepared(0)
+, m_in_flight(0)
+, m_error(0) {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	m_fd = ::syscall(__NR_io_uring_setup, entries, &params);
+	if (m_fd < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+	}
+	m_sq_ring = ::mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cq_ring = m_sq_ring;
+	} else if (m_sq_ring != MAP_FAILED) {
+		m_cq_ring = ::mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+	}
+	if (m_cq_ring != MAP_FAILED) {
+		m_sqes = static_cast<io_uring_sqe *>(::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+	}
+	if (m_sqes == MAP_FAILED) {
+		const auto error = errno;
+		unmap();
+		throw std::system_error(error, std::system_category());
+	}
+	const auto sq = static_cast<char *>(m_sq_ring);
+	const auto cq = static_cast<char *>(m_cq_ring);
+	m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	m_sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	m_cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+	m_entries = params.sq_entries;
+}
+
+uring::~uring() noexcept {
+	try {
+		while (m_in_flight > 0) {
+			wait();
+		}
+	} catch (...) {
+	}
+	unmap();
+}
+
+void uring::unmap() noexcept {
+	if (m_sqes != MAP_FAILED) {
+		::munmap(m_sqes, m_sqes_size);
+	}
+	if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) {
+		::munmap(m_cq_ring, m_cq_ring_size);
+	}
+	if (m_sq_ring != MAP_FAILED) {
+		::munmap(m_sq_ring, m_sq_ring_size);
+	}
+	::close(m_fd);
+}
+
+// Returns this thread's ring, or nullptr where io_uring is unavailable.
+uring * uring::local() noexcept {
+	thread_local std::unique_ptr<uring> ring;
+	thread_local bool tried = false;
+	if (!tried) {
+		tried = true;
+		try {
+			ring.reset(new uring(64));
+		} catch (const std::exception &) {
+		}
+	}
+	return ring.get();
+}
+
+void uring::drain_local() {
+	if (const auto ring = local()) {
+		ring->drain();
+	}
+}
+
+io_uring_sqe & uring::prepare(const uint8_t opcode, request & request, const int fd, const size_t offset) {
+	// Never have more requests outstanding than the completion queue can hold.
+	while (m_in_flight >= m_entries) {
+		wait();
+	}
+	const auto tail = *m_sq_tail;
+	const auto index = tail & m_sq_mask;
+	auto & sqe = m_sqes[index];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = opcode;
+	sqe.fd = fd;
+	sqe.off = offset;
+	sqe.user_data = reinterpret_cast<uintptr_t>(&request);
+	m_sq_array[index] = index;
+	__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++m_prepared;
+	++m_in_flight;
+	return sqe;
+}
+
+void uring::read(request & request, const int fd, void * buffer, const size_t amount, const size_t offset) {
+	auto & sqe = prepare(IORING_OP_READ, request, fd, offset);
+	sqe.addr = reinterpret_cast<uintptr_t>(buffer);
+	sqe.len = amount;
+	auto & stats = extract_stats::local();
+	++stats.read_calls;
+	stats.read_bytes += amount;
+}
+
+void uring::write(request & request, const int fd, const void * buffer, const size_t amount, const size_t offset) {
+	auto & sqe = prepare(IORING_OP_WRITE, request, fd, offset);
+	sqe.addr = reinterpret_cast<uintptr_t>(buffer);
+	sqe.len = amount;
+	auto & stats = extract_stats::local();
+	++stats.write_calls;
+	stats.write_bytes += amount;
+}
+
+void uring::enter(const unsigned min_complete) {
+	const auto flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	for (;;) {
+		const auto result = ::syscall(__NR_io_uring_enter, m_fd, m_prepared, min_complete, flags, nullptr, 0);
+		if (result >= 0) {
+			m_prepared -= result;
+			return;
+		} else if (errno != EINTR) {
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+}
+
+void uring::submit() {
+	if (m_prepared > 0) {
+		enter(0);
+	}
+}
+
+void uring::reap() {
+	auto head = *m_cq_head;
+	const auto tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		const auto & cqe = m_cqes[head & m_cq_mask];
+		const auto request = reinterpret_cast<uring::request *>(cqe.user_data);
+		const auto result = cqe.res;
+		__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+		--m_in_flight;
+		request->complete(result);
+	}
+}
+
+// Submits whatever is prepared and handles at least one completion.
+void uring::wait() {
+	reap();
+	if (m_in_flight > 0) {
+		enter(1);
+		reap();
+	}
+}
+
+// Waits for everything in flight and reports the first write that failed.
+void uring::drain() {
+	while (m_in_flight > 0) {
+		wait();
+	}
+	if (m_error != 0) {
+		const auto error = m_error;
+		m_error = 0;
+		throw std::system_error(error, std::system_category());
+	}
+}
+
+std::unique_ptr<uint8_t[]> uring::acquire() {
+	if (m_pool.empty()) {
+		return std::unique_ptr<uint8_t[]>(new uint8_t[obufstream::default_block_size]);
+	} else {
+		auto buffer = std::move(m_pool.back());
+		m_pool.pop_back();
+		return buffer;
+	}
+}
+
+void uring::release(std::unique_ptr<uint8_t[]> buffer) {
+	if (m_pool.size() < m_entries) {
+		m_pool.push_back(std::move(buffer));
+	}
+}
+
+// Reads ahead in blocks while the stream is consumed sequentially.
+struct iuringstream_impl final : ibufstream {
+	static constexpr size_t depth = 4;
+
+	struct block final : uring::request {
+		uring & m_ring;
+		int m_fd;
+		std::unique_ptr<uint8_t[]> m_data;
+		size_t m_offset;
+		size_t m_wanted;
+		size_t m_filled;
+		int m_error;
+		bool m_pending;
+		bool m_loaded;
+
+		inline block(uring & ring, const int fd, const size_t block_size)
+		: m_ring(ring)
+		, m_fd(fd)
+		, m_data(new uint8_t[block_size])
+		, m_offset(0)
+		, m_wanted(0)
+		, m_filled(0)
+		, m_error(0)
+		, m_pending(false)
+		, m_loaded(false)
+		{}
+
+		void load(const size_t offset, const size_t wanted) {
+			m_offset = offset;
+			m_wanted = wanted;
+			m_filled = 0;
+			m_error = 0;
+			m_loaded = true;
+			m_pending = true;
+			m_ring.read(*this, m_fd, m_data.get(), m_wanted, m_offset);
+		}
+
+		void complete(const int result) override {
+			if (result > 0 && m_filled + result < m_wanted) {
+				m_filled += result;
+				m_ring.read(*this, m_fd, m_data.get() + m_filled, m_wanted - m_filled, m_offset + m_filled);
+			} else if (result == -EINTR || result == -EAGAIN) {
+				m_ring.read(*this, m_fd, m_data.get() + m_filled, m_wanted - m_filled, m_offset + m_filled);
+			} else {
+				if (result >= 0) {
+					m_filled += result;
+				} else {
+					m_error = -result;
+				}
+				m_pending = false;
+			}
+		}
+	};
+
+	uring & m_ring;
+	int m_fd;
+	size_t m_size;
+	size_t m_block_size;
+	std::vector<std::unique_ptr<block>> m_blocks;
+	size_t m_position;
+	size_t m_last_block;
+
+	inline iuringstream_impl(uring & ring, const int fd, const size_t size, const size_t block_size)
+	: m_ring(ring)
+	, m_fd(fd)
+	, m_size(size)
+	, m_block_size(block_size)
+	, m_position(0)
+	, m_last_block(0) {
+		for (size_t i = 0; i < depth; ++i) {
+			m_blocks.emplace_back(new block(ring, fd, block_size));
+		}
+	}
+
+	~iuringstream_impl() noexcept {
+		try {
+			for (const auto & block : m_blocks) {
+				while (block->m_pending) {
+					m_ring.wait();
+				}
+			}
+		} catch (...) {
+		}
+		::close(m_fd);
+	}
+
+	// Returns the slot for the block with the given number, starting a read
+	// for it unless it is loaded or on its way.
+	block & fetch(const size_t number) {
+		auto & slot = *m_blocks[number % depth];
+		const auto offset = number * m_block_size;
+		if (!slot.m_loaded || slot.m_offset != offset) {
+			while (slot.m_pending) {
+				m_ring.wait();
+			}
+			slot.load(offset, std::min(m_block_size, m_size - offset));
+		}
+		return slot;
+	}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		const uint8_t * data;
+		const auto len = std::min(amount, peek(data));
+		memcpy(buffer, data, len);
+		m_position += len;
+		return len;
+	}
+
+	void seek(const size_t offset) override {
+		m_position = offset;
+	}
+
+	bool locate(int & fd, size_t & offset) noexcept override {
+		fd = m_fd;
+		offset = m_position;
+		return true;
+	}
+
+	void advise(const size_t offset, const size_t size, const advice advice) noexcept override {
+		advise_file(m_fd, offset, size, advice);
+	}
+
+	size_t peek(const uint8_t *& data) override {
+		if (m_position >= m_size) {
+			data = nullptr;
+			return 0;
+		}
+		const auto number = m_position / m_block_size;
+		auto & current = fetch(number);
+		if (number == m_last_block + 1) {
+			const auto blocks = (m_size + m_block_size - 1) / m_block_size;
+			for (size_t i = 1; i < depth && number + i < blocks; ++i) {
+				fetch(number + i);
+			}
+		}
+		m_last_block = number;
+		m_ring.submit();
+		while (current.m_pending) {
+			m_ring.wait();
+		}
+		if (current.m_error != 0) {
+			const auto error = current.m_error;
+			current.m_loaded = false;
+			throw std::system_error(error, std::system_category());
+		}
+		const auto skip = m_position - current.m_offset;
+		data = current.m_data.get() + skip;
+		return current.m_filled > skip ? current.m_filled - skip : 0;
+	}
+
+	void consume(const size_t amount) noexcept override {
+		m_position += amount;
+	}
+
+	bool seekable() const noexcept override {
+		return true;
+	}
+};
+
+constexpr size_t iuringstream_impl::depth;
+
+// Output descriptors stay open until the last write to them completes.
+struct uring_file {
+	int m_fd;
+
+	inline explicit uring_file(const int fd) noexcept
+	: m_fd(fd)
+	{}
+
+	~uring_file() noexcept {
+		::close(m_fd);
+	}
+};
+
+// A block handed to the ring; it owns its buffer and frees itself once
+// the kernel has written all of it.
+struct uring_write final : uring::request {
+	uring & m_ring;
+	std::shared_ptr<uring_file> m_file;
+	std::unique_ptr<uint8_t[]> m_data;
+	size_t m_length;
+	size_t m_done;
+	size_t m_offset;
+
+	inline uring_write(uring & ring, std::shared_ptr<uring_file> file, std::unique_ptr<uint8_t[]> data, const size_t length, const size_t offset)
+	: m_ring(ring)
+	, m_file(std::move(file))
+	, m_data(std::move(data))
+	, m_length(length)
+	, m_done(0)
+	, m_offset(offset)
+	{}
+
+	void start() {
+		m_ring.write(*this, m_file->m_fd, m_data.get() + m_done, m_length - m_done, m_offset + m_done);
+	}
+
+	void complete(const int result) override {
+		if (result > 0 && m_done + result < m_length) {
+			m_done += result;
+			start();
+		} else if (result == -EINTR || result == -EAGAIN) {
+			start();
+		} else {
+			if (result < 0) {
+				m_ring.fail(-result);
+			} else if (result == 0) {
+				m_ring.fail(EIO);
+			}
+			m_ring.release(std::move(m_data));
+			delete this;
+		}
+	}
+};
+
+// Writes behind: full blocks are queued on the ring and the stream moves
+// on to a fresh buffer.  uring::drain() reports failed writes.
+struct ouringstream_impl final : obufstream {
+	uring & m_ring;
+	std::shared_ptr<uring_file> m_file;
+	std::unique_ptr<uint8_t[]> m_buffer;
+	size_t m_used;
+	size_t m_offset;
+
+	inline ouringstream_impl(uring & ring, const int fd)
+	: m_ring(ring)
+	, m_file(std::make_shared<uring_file>(fd))
+	, m_used(0)
+	, m_offset(0)
+	{}
+
+	~ouringstream_impl() noexcept {
+		try {
+			flush();
+		} catch (...) {
+		}
+	}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		flush();
+		m_ring.drain();
+		const auto result = ::pread(m_file->m_fd, buffer, amount, m_offset);
+		if (result >= 0) {
+			m_offset += result;
+			return result;
+		} else {
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	size_t try_write(const void * buffer, const size_t amount) override {
+		uint8_t * data;
+		const auto len = std::min(amount, reserve(data));
+		memcpy(data, buffer, len);
+		commit(len);
+		return len;
+	}
+
+	void flush() override {
+		if (m_used > 0) {
+			std::unique_ptr<uring_write> request(new uring_write(m_ring, m_file, std::move(m_buffer), m_used, m_offset));
+			request->start();
+			request.release();
+			m_offset += m_used;
+			m_used = 0;
+			m_ring.submit();
+		}
+	}
+
+	void seek(const size_t offset) override {
+		flush();
+		m_offset = offset;
+	}
+
+	bool locate(int & fd, size_t & offset) noexcept override {
+		fd = m_file->m_fd;
+		offset = m_offset;
+		return m_used == 0;
+	}
+
+	size_t reserve(uint8_t *& data) override {
+		if (m_used == obufstream::default_block_size) {
+			flush();
+		}
+		if (!m_buffer) {
+			m_buffer = m_ring.acquire();
+		}
+		data = m_buffer.get() + m_used;
+		return obufstream::default_block_size - m_used;
+	}
+
+	void commit(const size_t amount) noexcept override {
+		m_used += amount;
+	}
+};
+
+std::unique_ptr<ibufstream> ibufstream::open_uring(const std::string & filename, const size_t block_size) {
+	const auto ring = uring::local();
+	if (ring == nullptr || filename == "-") {
+		return open(filename, block_size);
+	}
+	const auto fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	struct stat st;
+	if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		return std::unique_ptr<ibufstream>(new iuringstream_impl(*ring, fd, st.st_size, block_size));
+	} else {
+		::close(fd);
+		return open(filename, block_size);
+	}
+}
+
+std::unique_ptr<obufstream> obufstream::create_uring(const std::string & filename, const size_t size) {
+	const auto ring = uring::local();
+	if (ring == nullptr) {
+		return create(filename, size);
+	} else {
+		return std::unique_ptr<obufstream>(new ouringstream_impl(*ring, create_file(filename, size)));
+	}
+}
+
+// Walks the blocks a buffered stream exposes through peek() and hands
+// whatever was decoded back through consume() when it goes out of scope.
+// It reads no more than limit bytes, which keeps a decoder inside its
+// entry.
+template<typename Stream>
+struct block_cursor {
+	Stream & m_stream;
+	const uint8_t * m_begin;
+	const uint8_t * m_pos;
+	const uint8_t * m_end;
+	size_t m_consumed;
+	size_t m_limit;
+
+	inline block_cursor(Stream & stream, const size_t limit = SIZE_MAX)
+	: m_stream(stream)
+	, m_consumed(0)
+	, m_limit(limit) {
+		const auto available = std::min(m_stream.peek(m_begin), m_limit);
+		m_pos = m_begin;
+		m_end = m_begin + available;
+	}
+
+	~block_cursor() noexcept {
+		m_stream.consume(m_pos - m_begin);
+	}
+
+	inline size_t available() const noexcept {
+		return m_end - m_pos;
+	}
+
+	inline bool fill() {
+		if (m_pos < m_end) {
+			return true;
+		}
+		m_consumed += m_pos - m_begin;
+		m_stream.consume(m_pos - m_begin);
+		if (m_consumed == m_limit) {
+			m_begin = m_pos = m_end = nullptr;
+			return false;
+		}
+		const auto available = std::min(m_stream.peek(m_begin), m_limit - m_consumed);
+		m_pos = m_begin;
+		m_end = m_begin + available;
+		return available > 0;
+	}
+
+	// Whether the next amount bytes can be read, which word() takes care of
+	// when they straddle blocks.
+	inline bool ready(size_t) {
+		return fill();
+	}
+
+	// The bytes read through this cursor so far.
+	inline size_t consumed() const noexcept {
+		return m_consumed + (m_pos - m_begin);
+	}
+
+	inline uint8_t byte() noexcept {
+		return *m_pos++;
+	}
+
+	// Fails when the input ends after the first byte, which is consumed
+	// all the same.
+	inline bool word(uint16_t & value) {
+		if (available() >= 2) {
+			value = m_pos[0] | (m_pos[1] << 8);
+			m_pos += 2;
+			return true;
+		}
+		const uint16_t low = byte();
+		if (!fill()) {
+			return false;
+		}
+		value = low | (byte() << 8);
+		return true;
+	}
+};
+
+// Copies 16 bytes with one unaligned SSE2 or NEON load and store.
+static inline void copy16(uint8_t * out, const uint8_t * in) noexcept {
+#if defined(__SSE2__)
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_loadu_si128(reinterpret_cast<const __m128i *>(in)));
+#elif defined(__ARM_NEON)
+	vst1q_u8(out, vld1q_u8(in));
+#else
+	memcpy(out, in, 16);
+#endif
+}
+
+// The LZRW state machine on its own, so that the decode loop can be
+// instantiated for concrete sources and sinks as well as behind istream.
+struct lzrw_decoder {
+	uint8_t m_window[4096];
+	size_t m_window_index;
+	uint16_t m_control_bits;
+	uint8_t m_control_remaining;
+	size_t m_match_distance;
+	size_t m_match_remaining;
+	size_t m_output;
+	size_t m_matches;
+	size_t m_match_bytes;
+
+	inline lzrw_decoder() noexcept
+	: m_window{}
+	, m_window_index(0)
+	, m_control_bits(0)
+	, m_control_remaining(0)
+	, m_match_distance(0)
+	, m_match_remaining(0)
+	, m_output(0)
+	, m_matches(0)
+	, m_match_bytes(0)
+	{}
+
+	inline void restore(const lzrw_state & state) noexcept {
+		static_assert(sizeof(state.window) == sizeof(m_window), "window sizes differ");
+		memcpy(m_window, state.window, sizeof(m_window));
+		m_window_index = state.window_index;
+		m_control_bits = state.control_bits;
+		m_control_remaining = state.control_remaining;
+		m_match_distance = state.match_distance;
+		m_match_remaining = state.match_remaining;
+	}
+
+	inline void save(lzrw_state & state) const noexcept {
+		memcpy(state.window, m_window, sizeof(m_window));
+		state.window_index = m_window_index;
+		state.control_bits = m_control_bits;
+		state.control_remaining = m_control_remaining;
+		state.match_distance = m_match_distance;
+		state.match_remaining = m_match_remaining;
+	}
+
+	// Moves what this decoder has counted into the thread's stats.
+	void record() noexcept {
+		auto & stats = extract_stats::local();
+		stats.literals += m_output - m_match_bytes;
+		stats.matches += m_matches;
+		stats.match_bytes += m_match_bytes;
+		m_output = 0;
+		m_matches = 0;
+		m_match_bytes = 0;
+	}
+
+	static inline void decode_token(const uint16_t token, size_t & distance, size_t & len) noexcept {
+		const size_t ofs = ((token & 0xf000) >> 4) | (token & 0xff);
+		distance = ofs > 0 ? ofs : sizeof(m_window);
+		len = ((token & 0xf00) >> 8) + 1;
+	}
+
+	// Copies a back-reference to out, where begin is the start of the
+	// current read.  Anything further back than begin comes from the window,
+	// whose wrap is handled once per match.
+	inline void copy_match(const uint8_t * begin, uint8_t * out, const size_t distance, size_t len) noexcept {
+		const size_t produced = out - begin;
+		if (distance > produced) {
+			const auto back = distance - produced;
+			const auto index = (m_window_index + sizeof(m_window) - back) % sizeof(m_window);
+			const auto from_window = std::min(len, back);
+			const auto first = std::min(from_window, sizeof(m_window) - index);
+			memcpy(out, m_window + index, first);
+			memcpy(out + first, m_window, from_window - first);
+			out += from_window;
+			len -= from_window;
+			if (len == 0) {
+				return;
+			}
+		}
+		const auto src = out - distance;
+		if (distance >= len) {
+			memcpy(out, src, len);
+		} else {
+			for (size_t i = 0; i < len; ++i) {
+				out[i] = src[i];
+			}
+		}
+	}
+
+	// Keeps the tail of what this read produced as history for the next one.
+	inline void remember(const uint8_t * data, const size_t len) noexcept {
+		if (len >= sizeof(m_window)) {
+			memcpy(m_window, data + len - sizeof(m_window), sizeof(m_window));
+			m_window_index = 0;
+		} else {
+			const auto first = std::min(len, sizeof(m_window) - m_window_index);
+			memcpy(m_window + m_window_index, data, first);
+			memcpy(m_window, data + first, len - first);
+			m_window_index = (m_window_index + len) % sizeof(m_window);
+		}
+	}
+
+	// Decodes up to amount bytes to buffer and returns how many there were
+	// before the input ran out.
+	template<typename Cursor>
+	size_t decode(Cursor & input, uint8_t * buffer, const size_t amount) {
+		// A control word with all of its tokens takes at most this much
+		// input and produces at most this much output, plus the 16 bytes
+		// that a copy16() may run past either.
+		constexpr size_t max_group_input = 2 + 16 * 2 + 16;
+		constexpr size_t max_group_output = 16 * 16 + 16;
+
+		const auto begin = buffer;
+		const auto end = begin + amount;
+		auto out = begin;
+		size_t matches = 0;
+		size_t match_bytes = 0;
+		if (m_match_remaining > 0) {
+			const auto len = std::min(m_match_remaining, amount);
+			copy_match(begin, out, m_match_distance, len);
+			out += len;
+			match_bytes += len;
+			m_match_remaining -= len;
+		}
+
+		while (out < end) {
+			if (m_control_remaining == 0) {
+				if (input.available() >= max_group_input && size_t(end - out) >= max_group_output) {
+					auto in = input.m_pos;
+					// Bit 16 stops the scan for literals after the last token.
+					unsigned bits = in[0] | (in[1] << 8) | 0x10000;
+					in += 2;
+					matches += __builtin_popcount(bits) - 1;
+					for (unsigned tokens = 16;;) {
+						// The run of literals up to the next match is copied
+						// in one go; what it overwrites past the run is
+						// rewritten by the tokens that follow.
+						const unsigned run = __builtin_ctz(bits);
+						copy16(out, in);
+						out += run;
+						in += run;
+						bits >>= run;
+						tokens -= run;
+						if (tokens == 0) {
+							break;
+						}
+						size_t distance, len;
+						decode_token(in[0] | (in[1] << 8), distance, len);
+						in += 2;
+						if (distance >= 16 && distance <= size_t(out - begin)) {
+							copy16(out, out - distance);
+						} else {
+							copy_match(begin, out, distance, len);
+						}
+						out += len;
+						match_bytes += len;
+						bits >>= 1;
+						if (--tokens == 0) {
+							break;
+						}
+					}
+					input.m_pos = in;
+					continue;
+				} else if (!input.ready(2) || !input.word(m_control_bits)) {
+					// A control word cut short ends the input.
+					break;
+				}
+				m_control_remaining = 16;
+			}
+			if (!input.ready(m_control_bits & 0x1 ? 2 : 1)) {
+				break;
+			}
+			if (m_control_bits & 0x1) {
+				uint16_t token;
+				if (!input.word(token)) {
+					break;
+				}
+				size_t distance, len;
+				decode_token(token, distance, len);
+				const auto now = std::min(len, size_t(end - out));
+				copy_match(begin, out, distance, now);
+				out += now;
+				++matches;
+				match_bytes += now;
+				m_match_distance = distance;
+				m_match_remaining = len - now;
+			} else {
+				*out++ = input.byte();
+			}
+			m_control_bits >>= 1;
+			--m_control_remaining;
+		}
+
+		remember(begin, out - begin);
+		m_output += out - begin;
+		m_matches += matches;
+		m_match_bytes += match_bytes;
+		return out - begin;
+	}
+};
+
+// Reads no more than limit bytes of the stream.
+struct ilzrwstream_impl final : ilzrwstream {
+	std::unique_ptr<ibufstream> m_buffer;
+	ibufstream & m_stream;
+	size_t m_limit;
+	lzrw_decoder m_decoder;
+
+	inline ilzrwstream_impl(ibufstream & stream, const size_t limit = SIZE_MAX) noexcept
+	: m_stream(stream)
+	, m_limit(limit)
+	{}
+
+	inline ilzrwstream_impl(std::unique_ptr<ibufstream> buffer) noexcept
+	: m_buffer(std::move(buffer))
+	, m_stream(*m_buffer)
+	, m_limit(SIZE_MAX)
+	{}
+
+	~ilzrwstream_impl() noexcept {
+		m_decoder.record();
+	}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		block_cursor<ibufstream> input(m_stream, m_limit);
+		const auto result = m_decoder.decode(input, static_cast<uint8_t *>(buffer), amount);
+		if (m_limit != SIZE_MAX) {
+			m_limit -= input.consumed();
+		}
+		return result;
+	}
+};
+
+std::unique_ptr<ilzrwstream> ilzrwstream::wrap(istream & stream, const size_t block_size) {
+	return std::unique_ptr<ilzrwstream>(new ilzrwstream_impl(ibufstream::wrap(stream, block_size)));
+}
+
+std::unique_ptr<ilzrwstream> ilzrwstream::wrap(ibufstream & stream) {
+	return std::unique_ptr<ilzrwstream>(new ilzrwstream_impl(stream));
+}
+
+// Emits LZRW tokens in groups of 16 behind their control word.
+struct lzrw_writer {
+	std::vector<uint8_t> & m_out;
+	size_t m_control;
+	uint16_t m_bits;
+	unsigned m_count;
+
+	inline explicit lzrw_writer(std::vector<uint8_t> & out) noexcept
+	: m_out(out)
+	, m_control(0)
+	, m_bits(0)
+	, m_count(0)
+	{}
+
+	inline void token(const bool match) {
+		if (m_count == 0) {
+			m_control = m_out.size();
+			m_out.resize(m_out.size() + 2);
+		}
+		m_bits |= uint16_t(match) << m_count;
+		if (++m_count == 16) {
+			finish();
+		}
+	}
+
+	inline void literal(const uint8_t value) {
+		token(false);
+		m_out.push_back(value);
+	}
+
+	// A distance of 4096 is stored as 0.
+	inline void match(const size_t distance, const size_t len) {
+		token(true);
+		const auto ofs = distance % 4096;
+		m_out.push_back(ofs & 0xff);
+		m_out.push_back(((ofs >> 4) & 0xf0) | ((len - 1) & 0xf));
+	}
+
+	inline void finish() noexcept {
+		if (m_count > 0) {
+			m_out[m_control] = m_bits & 0xff;
+			m_out[m_control + 1] = m_bits >> 8;
+			m_bits = 0;
+			m_count = 0;
+		}
+	}
+};
+
+// Finds the longest match within reach by following chains of earlier
+// positions that start with the same three bytes, giving up after
+// max_chain of them.  Matches are taken greedily.
+struct lzrw_encoder {
+	static constexpr size_t window_size = 4096;
+	static constexpr size_t min_match = 3;
+	static constexpr size_t max_match = 16;
+	static constexpr unsigned hash_bits = 13;
+	static constexpr unsigned max_chain = 64;
+
+	// Positions plus one, so that zero ends a chain.
+	std::array<size_t, size_t(1) << hash_bits> m_head;
+	std::array<size_t, window_size> m_prev;
+
+	static inline size_t hash(const uint8_t * data) noexcept {
+		const uint32_t value = data[0] | (data[1] << 8) | (data[2] << 16);
+		return (value * 2654435761u) >> (32 - hash_bits);
+	}
+
+	inline void insert(const uint8_t * data, const size_t pos) noexcept {
+		auto & head = m_head[hash(data + pos)];
+		m_prev[pos % window_size] = head;
+		head = pos + 1;
+	}
+
+	void compress(const uint8_t * data, const size_t size, std::vector<uint8_t> & output) {
+		m_head.fill(0);
+		lzrw_writer writer(output);
+		size_t pos = 0;
+		while (pos < size) {
+			size_t best_len = 0;
+			size_t best_distance = 0;
+			if (size - pos >= min_match) {
+				const auto limit = std::min(max_match, size - pos);
+				auto candidate = m_head[hash(data + pos)];
+				for (unsigned chain = max_chain; candidate != 0 && chain > 0; --chain) {
+					const auto from = candidate - 1;
+					const auto distance = pos - from;
+					if (distance > window_size) {
+						break;
+					}
+					if (data[from + best_len] == data[pos + best_len]) {
+						size_t len = 0;
+						while (len < limit && data[from + len] == data[pos + len]) {
+							++len;
+						}
+						if (len > best_len) {
+							best_len = len;
+							best_distance = distance;
+							if (len == limit) {
+								break;
+							}
+						}
+					}
+					candidate = m_prev[from % window_size];
+				}
+			}
+			if (best_len >= min_match) {
+				writer.match(best_distance, best_len);
+			} else {
+				writer.literal(data[pos]);
+				best_len = 1;
+			}
+			// Positions too close to the end to hash are never looked up.
+			const auto next = pos + best_len;
+			const auto last = std::min(next, size >= min_match ? size - min_match + 1 : 0);
+			for (; pos < last; ++pos) {
+				insert(data, pos);
+			}
+			pos = next;
+		}
+		writer.finish();
+	}
+};
+
+constexpr size_t lzrw_encoder::window_size;
+constexpr size_t lzrw_encoder::min_match;
+constexpr size_t lzrw_encoder::max_match;
+
+void lzrw_compress(const void * data, const size_t size, std::vector<uint8_t> & output) {
+	static thread_local std::unique_ptr<lzrw_encoder> encoder;
+	if (!encoder) {
+		encoder.reset(new lzrw_encoder);
+	}
+	encoder->compress(static_cast<const uint8_t *>(data), size, output);
+}
+
+bitmap_names::bitmap_names(const std::string & input_filename, const char * extension)
+: m_name(input_filename == "-" ? std::string("stdin") : input_filename)
+, m_extension(extension)
+{
+	const auto slash = m_name.find_last_of('/');
+	auto dot = m_name.find_last_of('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+		dot = m_name.size();
+	}
+	m_name.resize(dot);
+	m_name += '.';
+	m_stem = m_name.size();
+	m_name.reserve(m_stem + std::numeric_limits<size_t>::digits10 + 1 + strlen(extension));
+}
+
+const std::string & bitmap_names::operator()(size_t index) {
+	char digits[std::numeric_limits<size_t>::digits10 + 1];
+	auto first = std::end(digits);
+	do {
+		*--first = char('0' + index % 10);
+		index /= 10;
+	} while (index > 0);
+	m_name.resize(m_stem);
+	m_name.append(first, std::end(digits));
+	m_name.append(m_extension);
+	return m_name;
+}
+
+std::string derive_output_filename(
+	const std::string & input_filename,
+	const size_t index
+) {
+	return bitmap_names(input_filename)(index);
+}
+
+std::runtime_error error(const char * format, ...) {
+	va_list args;
+
+	va_start(args, format);
+	const auto len = vsnprintf(nullptr, 0, format, args);
+	va_end(args);
+
+	std::vector<char> buffer(len + 1);
+	va_start(args, format);
+	vsnprintf(buffer.data(), buffer.size(), format, args);
+	va_end(args);
+
+	return std::runtime_error(buffer.data());
+}
+
+std::unique_ptr<ibufstream> open_archive(
+	const std::string & filename,
+	const extract_options & options
+) {
+	if (options.io_uring) {
+		return ibufstream::open_uring(filename);
+	} else {
+		return ibufstream::open(filename);
+	}
+}
+
+// Staging buffers larger than this are given back after use rather than
+// kept around for the next bitmap.
+constexpr size_t retained_buffer_size = 1024 * 1024;
+
+struct memory_budget_impl final : memory_budget {
+	size_t m_limit;
+	size_t m_used;
+	uint64_t m_next;
+	uint64_t m_serving;
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+
+	inline explicit memory_budget_impl(const size_t limit)
+	: m_limit(limit)
+	, m_used(0)
+	, m_next(0)
+	, m_serving(0)
+	{}
+
+	size_t limit() const noexcept override {
+		return m_limit;
+	}
+
+	void acquire(const size_t size) override {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		const auto ticket = m_next++;
+		m_changed.wait(lock, [this, ticket, size] {
+			return ticket == m_serving && (m_used == 0 || m_used + size <= m_limit);
+		});
+		m_used += size;
+		++m_serving;
+		m_changed.notify_all();
+	}
+
+	void release(const size_t size) noexcept override {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_used -= size;
+		m_changed.notify_all();
+	}
+};
+
+std::unique_ptr<memory_budget> memory_budget::create(const size_t limit) {
+	return std::unique_ptr<memory_budget>(new memory_budget_impl(limit));
+}
+
+// Buffers writes to any ostream, counting what went through.
+struct ostreambuf_impl final : obufstream {
+	ostream & m_stream;
+	block_pool m_block;
+	size_t m_used;
+	size_t m_written;
+
+	inline explicit ostreambuf_impl(ostream & stream)
+	: m_stream(stream)
+	, m_used(0)
+	, m_written(0)
+	{}
+
+	size_t try_read(void *, size_t) override {
+		throw std::system_error(EBADF, std::system_category());
+	}
+
+	size_t try_write(const void * buffer, const size_t amount) override {
+		uint8_t * data;
+		const auto len = std::min(amount, reserve(data));
+		memcpy(data, buffer, len);
+		commit(len);
+		return len;
+	}
+
+	void flush() override {
+		if (m_used > 0) {
+			m_stream.write(m_block.data(), m_used);
+			m_written += m_used;
+			m_used = 0;
+		}
+	}
+
+	void seek(size_t) override {
+		throw std::system_error(ESPIPE, std::system_category());
+	}
+
+	size_t reserve(uint8_t *& data) override {
+		if (m_used == default_block_size) {
+			flush();
+		}
+		data = m_block.data() + m_used;
+		return default_block_size - m_used;
+	}
+
+	void commit(const size_t amount) noexcept override {
+		m_used += amount;
+	}
+};
+
+// Fills a buffer of a fixed size.
+struct omemorystream_impl final : obufstream {
+	uint8_t * m_data;
+	size_t m_size;
+	size_t m_used;
+
+	inline omemorystream_impl(void * data, const size_t size) noexcept
+	: m_data(static_cast<uint8_t *>(data))
+	, m_size(size)
+	, m_used(0)
+	{}
+
+	size_t try_read(void *, size_t) override {
+		throw std::system_error(EBADF, std::system_category());
+	}
+
+	size_t try_write(const void * buffer, const size_t amount) override {
+		uint8_t * data;
+		const auto len = std::min(amount, reserve(data));
+		memcpy(data, buffer, len);
+		commit(len);
+		return len;
+	}
+
+	void seek(const size_t offset) override {
+		if (offset > m_size) {
+			throw std::system_error(EINVAL, std::system_category());
+		}
+		m_used = offset;
+	}
+
+	size_t reserve(uint8_t *& data) override {
+		if (m_used == m_size) {
+			throw std::system_error(ENOSPC, std::system_category());
+		}
+		data = m_data + m_used;
+		return m_size - m_used;
+	}
+
+	void commit(const size_t amount) noexcept override {
+		m_used += amount;
+	}
+};
+
+// Drops everything written to it.  Data is staged in a pooled block so
+// that decoders have somewhere to put it.
+struct odiscardstream_impl final : obufstream {
+	block_pool m_block;
+
+	size_t try_read(void *, size_t) override {
+		throw std::system_error(EBADF, std::system_category());
+	}
+
+	size_t try_write(const void *, const size_t amount) override {
+		return amount;
+	}
+
+	void seek(size_t) override {
+	}
+
+	size_t reserve(uint8_t *& data) override {
+		data = m_block.data();
+		return default_block_size;
+	}
+
+	void commit(size_t) noexcept override {
+	}
+};
+
+// Calls f with the concrete output stream that options select, so that
+// code templated on it can call straight into the sink.  Bitmaps bound for
+// a container are staged in a buffer that each thread reuses.
+template<typename F>
+void with_bitmap(
+	const std::string & filename,
+	const size_t amount,
+	const extract_options & options,
+	F f
+) {
+	const auto ring = options.io_uring ? uring::local() : nullptr;
+	extract_stats::local().entry_bytes += amount;
+	if (options.verify) {
+		odiscardstream_impl output;
+		f(output);
+	} else if (options.encoder != nullptr) {
+		memory_lease lease(options.memory, amount);
+		auto bitmap = options.encoder->acquire();
+		bitmap.resize(amount);
+		omemorystream_impl output(bitmap.data(), amount);
+		f(output);
+		options.encoder->add(filename, std::move(bitmap), std::move(lease));
+	} else if (options.output != nullptr && options.memory != nullptr && amount > options.memory->limit()) {
+		// Too large to stage, so decoded straight into the container while
+		// it waits for this one.
+		options.output->add(filename, amount, [&f](obufstream & output) {
+			f(output);
+		});
+	} else if (options.output != nullptr) {
+		memory_lease lease(options.memory, amount);
+		static thread_local std::vector<uint8_t> staging;
+		if (staging.size() < amount) {
+			staging.resize(amount);
+		}
+		omemorystream_impl output(staging.data(), amount);
+		f(output);
+		options.output->add(filename, staging.data(), amount);
+		if (staging.size() > retained_buffer_size) {
+			staging = std::vector<uint8_t>{};
+		}
+	} else if (options.map_output && amount > 0) {
+		omapstream_impl output(create_file(filename, amount), amount);
+		f(output);
+	} else if (ring != nullptr) {
+		ouringstream_impl output(*ring, create_file(filename, amount));
+		f(output);
+	} else {
+		block_pool block;
+		ofstream_impl file(create_file(filename, amount));
+		obufstream_impl output(file, block);
+		f(output);
+	}
+}
+
+// The file-to-file decode path: source cursor, decoder and sink are all
+// known types here, so the whole LZRW loop is compiled into one piece.
+// The input ends after limit bytes, which must decode to all of amount.
+template<typename Stream, typename Sink>
+void decode_bitmap(Stream & input, Sink & output, const size_t amount, const size_t limit = SIZE_MAX) {
+	lzrw_decoder decoder;
+	block_cursor<Stream> cursor(input, limit);
+	for (size_t remaining = amount; remaining > 0;) {
+		uint8_t * data;
+		const auto len = std::min(remaining, output.reserve(data));
+		const auto done = decoder.decode(cursor, data, len);
+		if (done < len) {
+			throw error("payload ends after %zu of %zu bytes", amount - remaining + done, amount);
+		}
+		output.commit(len);
+		remaining -= len;
+	}
+	decoder.record();
+	output.flush();
+}
+
+void export_bitmap(
+	istream & input,
+	const std::string & filename,
+	const size_t amount,
+	const extract_options & options
+) {
+	with_bitmap(filename, amount, options, [&input, amount](auto & output) {
+		for (size_t remaining = amount; remaining > 0;) {
+			uint8_t * data;
+			const auto len = std::min(remaining, output.reserve(data));
+			input.read(data, len);
+			output.commit(len);
+			remaining -= len;
+		}
+		output.flush();
+	});
+}
+
+bool is_unsupported_copy(const int error) noexcept {
+	return error == ENOSYS || error == EINVAL || error == EOPNOTSUPP || error == EXDEV;
+}
+
+size_t kernel_copy(ifstream & input, ofstream & output, const size_t amount) {
+	static std::atomic<bool> copy_file_range_supported{true};
+	static std::atomic<bool> sendfile_supported{true};
+	int input_fd, output_fd;
+	size_t input_offset, output_offset;
+	if (!input.locate(input_fd, input_offset) || !output.locate(output_fd, output_offset)) {
+		return 0;
+	}
+	auto & stats = extract_stats::local();
+	size_t copied = 0;
+	while (copied < amount && copy_file_range_supported) {
+		loff_t src = input_offset + copied;
+		loff_t dst = output_offset + copied;
+		const auto result = ::copy_file_range(input_fd, &src, output_fd, &dst, amount - copied, 0);
+		++stats.copy_calls;
+		if (result > 0) {
+			copied += result;
+			stats.copy_bytes += result;
+		} else if (result == 0) {
+			break;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EXDEV) {
+			break;
+		} else if (is_unsupported_copy(errno)) {
+			copy_file_range_supported = false;
+		} else {
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+	if (copied < amount && sendfile_supported) {
+		output.seek(output_offset + copied);
+		while (copied < amount) {
+			off_t src = input_offset + copied;
+			const auto result = ::sendfile(output_fd, input_fd, &src, amount - copied);
+			++stats.copy_calls;
+			if (result > 0) {
+				copied += result;
+				stats.copy_bytes += result;
+			} else if (result == 0) {
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			} else if (is_unsupported_copy(errno)) {
+				sendfile_supported = false;
+				break;
+			} else {
+				throw std::system_error(errno, std::system_category());
+			}
+		}
+	}
+	if (copied > 0) {
+		input.seek(input_offset + copied);
+		output.seek(output_offset + copied);
+	}
+	return copied;
+}
+
+void export_bitmap(
+	ibufstream & input,
+	const std::string & filename,
+	const size_t amount,
+	const extract_options & options
+) {
+	with_bitmap(filename, amount, options, [&input, amount](auto & output) {
+		for (size_t remaining = amount - kernel_copy(input, output, amount); remaining > 0;) {
+			const uint8_t * data;
+			const auto available = input.peek(data);
+			if (available == 0) {
+				throw end_of_stream{};
+			}
+			const auto len = std::min(remaining, available);
+			output.write(data, len);
+			input.consume(len);
+			remaining -= len;
+		}
+		output.flush();
+	});
+}
+
+void export_plain_bitmap(
+	ibufstream & stream,
+	bitmap_names & names,
+	const size_t index,
+	const extract_options & options,
+	const size_t offset,
+	const size_t end
+) {
+	const auto size = stream.read<uint32_t>();
+	if (end != SIZE_MAX && offset + 1 + 4 + size_t(size) > end) {
+		throw error("%u bytes run past the end of the entry", size);
+	}
+	export_bitmap(stream, names(index), size, options);
+}
+
+// SHA-256, as the decode cache trusts a matching key with the output.
+struct sha256 {
+	std::array<uint32_t, 8> m_state{{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	}};
+	std::array<uint8_t, 64> m_block;
+	size_t m_used = 0;
+	uint64_t m_length = 0;
+
+	static uint32_t rotate(const uint32_t x, const unsigned n) noexcept {
+		return (x >> n) | (x << (32 - n));
+	}
+
+	void compress(const uint8_t * data) noexcept {
+		static const uint32_t k[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+		};
+		uint32_t w[64];
+		for (size_t i = 0; i < 16; ++i) {
+			w[i] = uint32_t(data[4 * i]) << 24 | uint32_t(data[4 * i + 1]) << 16 | uint32_t(data[4 * i + 2]) << 8 | data[4 * i + 3];
+		}
+		for (size_t i = 16; i < 64; ++i) {
+			const auto s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			const auto s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		auto v = m_state;
+		for (size_t i = 0; i < 64; ++i) {
+			const auto s1 = rotate(v[4], 6) ^ rotate(v[4], 11) ^ rotate(v[4], 25);
+			const auto ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+			const auto t1 = v[7] + s1 + ch + k[i] + w[i];
+			const auto s0 = rotate(v[0], 2) ^ rotate(v[0], 13) ^ rotate(v[0], 22);
+			const auto maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+			v = {{t1 + s0 + maj, v[0], v[1], v[2], v[3] + t1, v[4], v[5], v[6]}};
+		}
+		for (size_t i = 0; i < 8; ++i) {
+			m_state[i] += v[i];
+		}
+	}
+
+	void update(const void * buffer, size_t amount) noexcept {
+		auto data = static_cast<const uint8_t *>(buffer);
+		m_length += amount;
+		if (m_used > 0) {
+			const auto len = std::min(amount, m_block.size() - m_used);
+			memcpy(&m_block[m_used], data, len);
+			m_used += len;
+			data += len;
+			amount -= len;
+			if (m_used < m_block.size()) {
+				return;
+			}
+			compress(m_block.data());
+			m_used = 0;
+		}
+		for (; amount >= m_block.size(); data += m_block.size(), amount -= m_block.size()) {
+			compress(data);
+		}
+		memcpy(m_block.data(), data, amount);
+		m_used = amount;
+	}
+
+	std::array<uint8_t, 32> digest() noexcept {
+		const auto bits = m_length * 8;
+		const uint8_t pad = 0x80;
+		update(&pad, 1);
+		while (m_used != 56) {
+			const uint8_t zero = 0;
+			update(&zero, 1);
+		}
+		for (int i = 7; i >= 0; --i) {
+			m_block[56 + 7 - i] = uint8_t(bits >> (8 * i));
+		}
+		compress(m_block.data());
+		std::array<uint8_t, 32> result;
+		for (size_t i = 0; i < 32; ++i) {
+			result[i] = uint8_t(m_state[i / 4] >> (24 - 8 * (i % 4)));
+		}
+		return result;
+	}
+};
+
+// Where the bitmap decoded from the entry at [offset, end) is cached: the
+// hex digest of the whole entry, header included, split after two digits.
+std::string cache_filename(ibufstream & stream, const std::string & directory, const size_t offset, const size_t end) {
+	sha256 hash;
+	stream.seek(offset);
+	for (size_t remaining = end - offset; remaining > 0;) {
+		const uint8_t * data;
+		const auto available = stream.peek(data);
+		if (available == 0) {
+			throw end_of_stream{};
+		}
+		const auto len = std::min(remaining, available);
+		hash.update(data, len);
+		stream.consume(len);
+		remaining -= len;
+	}
+	const auto digest = hash.digest();
+	std::string filename = directory + "/xx/";
+	for (const auto byte : digest) {
+		static const char hex[] = "0123456789abcdef";
+		filename += hex[byte >> 4];
+		filename += hex[byte & 15];
+	}
+	const auto subdirectory = directory.size() + 1;
+	filename[subdirectory] = filename[subdirectory + 3];
+	filename[subdirectory + 1] = filename[subdirectory + 4];
+	filename += ".bmp";
+	return filename;
+}
+
+void make_directory(const std::string & directory) {
+	if (::mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) {
+		throw std::system_error(errno, std::system_category());
+	}
+}
+
+// Puts a cached bitmap at filename, linking it if both are on the same
+// filesystem.  A cached file of the wrong size counts as a miss.
+bool fetch_cached(const std::string & cached, const std::string & filename, const size_t size, const extract_options & options) {
+	struct stat st;
+	if (::stat(cached.c_str(), &st) != 0 || size_t(st.st_size) != size) {
+		return false;
+	} else if (::link(cached.c_str(), filename.c_str()) == 0) {
+		return true;
+	} else if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+		throw std::system_error(errno, std::system_category());
+	}
+	const auto input = ibufstream::open(cached);
+	export_bitmap(*input, filename, size, options);
+	return true;
+}
+
+// Adds a freshly written bitmap to the cache.  Someone else may have added
+// the same one first, and a cache on another filesystem is left alone.
+void store_cached(const std::string & directory, const std::string & filename, const std::string & cached) {
+	make_directory(directory);
+	make_directory(cached.substr(0, cached.find_last_of('/')));
+	if (::link(filename.c_str(), cached.c_str()) != 0 && errno != EEXIST && errno != EXDEV && errno != EPERM && errno != EMLINK) {
+		throw std::system_error(errno, std::system_category());
+	}
+}
+
+void export_compressed_bitmap(
+	ibufstream & stream,
+	bitmap_names & names,
+	const size_t index,
+	const extract_options & options,
+	const size_t offset,
+	const size_t end
+) {
+	if (end != SIZE_MAX && offset + 1 + 4 + 4 + 1 > end) {
+		throw error("header runs past the end of the entry");
+	}
+	const auto size1 = stream.read<uint32_t>();
+	stream.read<uint32_t>();
+	stream.read<uint8_t>();
+	// The payload may not run on into whatever follows the entry.
+	const auto limit = end == SIZE_MAX ? SIZE_MAX : end - (offset + 1 + 4 + 4 + 1);
+	const auto & filename = names(index);
+	const auto uncached = options.output != nullptr || options.encoder != nullptr || options.verify;
+	const auto cached = options.cache_directory.empty() || uncached || end == SIZE_MAX
+		? std::string{}
+		: cache_filename(stream, options.cache_directory, offset, end);
+	if (!cached.empty()) {
+		// Cached bitmaps share their inode with outputs, which therefore
+		// must never be rewritten in place.
+		if (::unlink(filename.c_str()) != 0 && errno != ENOENT) {
+			throw std::system_error(errno, std::system_category());
+		}
+		if (fetch_cached(cached, filename, size1, options)) {
+			return;
+		}
+		stream.seek(offset + 10);
+	}
+	with_bitmap(filename, size1, options, [&stream, size1, limit](auto & output) {
+		decode_bitmap(stream, output, size1, limit);
+	});
+	if (!cached.empty()) {
+		store_cached(options.cache_directory, filename, cached);
+	}
+}
+
+// Writes ustar headers, with a pax header in front of names too long for
+// one, and pads every member to a whole block.
+struct tar_container_impl final : container {
+	static constexpr size_t block_size = 512;
+
+	std::unique_ptr<ostream> m_file;
+	ostream & m_stream;
+	std::mutex m_mutex;
+	time_t m_time;
+	bool m_broken;
+
+	inline explicit tar_container_impl(ostream & stream)
+	: m_stream(stream)
+	, m_time(::time(nullptr))
+	, m_broken(false)
+	{}
+
+	inline explicit tar_container_impl(std::unique_ptr<ostream> file)
+	: m_file(std::move(file))
+	, m_stream(*m_file)
+	, m_time(::time(nullptr))
+	, m_broken(false)
+	{}
+
+	void header(const char * name, const char type, const size_t size) {
+		std::array<char, block_size> block{};
+		strncpy(&block[0], name, 100);
+		snprintf(&block[100], 8, "%07o", 0644);
+		snprintf(&block[108], 8, "%07o", 0);
+		snprintf(&block[116], 8, "%07o", 0);
+		snprintf(&block[124], 12, "%011zo", size);
+		snprintf(&block[136], 12, "%011llo", static_cast<unsigned long long>(m_time));
+		memset(&block[148], ' ', 8);
+		block[156] = type;
+		memcpy(&block[257], "ustar", 6);
+		memcpy(&block[263], "00", 2);
+		unsigned checksum = 0;
+		for (const auto c : block) {
+			checksum += static_cast<uint8_t>(c);
+		}
+		snprintf(&block[148], 8, "%06o", checksum);
+		m_stream.write(block);
+	}
+
+	void member(const char * name, const char type, const void * data, const size_t size) {
+		header(name, type, size);
+		m_stream.write(data, size);
+		pad(size);
+	}
+
+	void pad(const size_t size) {
+		static const std::array<char, block_size> padding{};
+		m_stream.write(padding.data(), (block_size - size % block_size) % block_size);
+	}
+
+	void check() const {
+		if (m_broken) {
+			throw error("container is incomplete after an earlier error");
+		}
+	}
+
+	void add(const std::string & name, const void * data, const size_t size) override {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		check();
+		const auto path = begin(name);
+		member(path.c_str(), '0', data, size);
+	}
+
+	void add(const std::string & name, const size_t size, const std::function<void(obufstream &)> & write) override {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		check();
+		const auto path = begin(name);
+		header(path.c_str(), '0', size);
+		m_broken = true;
+		ostreambuf_impl output(m_stream);
+		write(output);
+		output.flush();
+		if (output.m_written != size) {
+			throw error("%s: %zu bytes written for %zu", name.c_str(), output.m_written, size);
+		}
+		pad(size);
+		m_broken = false;
+	}
+
+	// Drops empty, `.` and `..` components, so that unpacking the tar
+	// cannot write outside the directory it is unpacked in, and puts a pax
+	// header in front of long names.
+	std::string begin(const std::string & name) {
+		std::string path;
+		for (size_t start = 0; start <= name.size();) {
+			const auto end = std::min(name.find('/', start), name.size());
+			const auto part = name.substr(start, end - start);
+			if (!part.empty() && part != "." && part != "..") {
+				if (!path.empty()) {
+					path += '/';
+				}
+				path += part;
+			}
+			start = end + 1;
+		}
+		if (path.empty()) {
+			throw error("%s: no name left for the member", name.c_str());
+		}
+		const auto len = path.size();
+		if (len >= 100) {
+			// A pax record counts its own length, digits included.
+			const auto record_len = len + sizeof(" path=\n") - 1;
+			auto total = record_len;
+			while (total != record_len + std::to_string(total).size()) {
+				total = record_len + std::to_string(total).size();
+			}
+			const auto record = std::to_string(total) + " path=" + path + "\n";
+			member("PaxHeader", 'x', record.data(), record.size());
+		}
+		return path;
+	}
+
+	void finish() override {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		check();
+		const std::array<char, 2 * block_size> trailer{};
+		m_stream.write(trailer);
+		m_stream.flush();
+	}
+};
+
+constexpr size_t tar_container_impl::block_size;
+
+std::unique_ptr<container> container::tar(ostream & stream) {
+	return std::unique_ptr<container>(new tar_container_impl(stream));
+}
+
+std::unique_ptr<container> container::tar(const std::string & filename) {
+	if (filename == "-") {
+		const auto fd = ::fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0) {
+			throw std::system_error(errno, std::system_category());
+		}
+		std::unique_ptr<ofstream> file(new ofstream_impl(fd));
+		std::unique_ptr<ostream> output(new obufstream_impl(std::move(file), obufstream::default_block_size));
+		return std::unique_ptr<container>(new tar_container_impl(std::move(output)));
+	} else {
+		return std::unique_ptr<container>(new tar_container_impl(obufstream::create(filename, 0)));
+	}
+}
+
+// The pixels of a BMP file, as found in place.
+struct bmp_image {
+	uint32_t width;
+	uint32_t height;
+	unsigned bits;
+	bool alpha;
+	// Rows are stored bottom-up unless this is set.
+	bool top_down;
+	size_t stride;
+	const uint8_t * pixels;
+	// BGRX quads of palettized images.
+	const uint8_t * palette;
+	size_t palette_size;
+};
+
+// Accepts uncompressed 1, 4, 8, 24 and 32 bit images, the last one with
+// alpha if its bit fields say so.
+bmp_image parse_bmp(const uint8_t * data, const size_t size) {
+	const auto u16 = [data](const size_t at) { return uint16_t(data[at] | data[at + 1] << 8); };
+	const auto u32 = [data](const size_t at) { return uint32_t(data[at] | data[at + 1] << 8 | data[at + 2] << 16 | uint32_t(data[at + 3]) << 24); };
+	if (size < 14 + 40 || data[0] != 'B' || data[1] != 'M') {
+		throw error("not a BMP image");
+	}
+	const auto pixel_offset = u32(10);
+	const auto header_size = u32(14);
+	const auto width = int32_t(u32(18));
+	const auto height = int32_t(u32(22));
+	const auto bits = u16(28);
+	const auto compression = u32(30);
+	const auto colors = u32(46);
+	if (header_size < 40 || header_size > size - 14 || width <= 0 || height == 0 || height == INT32_MIN) {
+		throw error("malformed BMP header");
+	}
+	bmp_image image;
+	image.width = width;
+	image.height = height < 0 ? -height : height;
+	image.bits = bits;
+	image.alpha = false;
+	image.top_down = height < 0;
+	image.palette = nullptr;
+	image.palette_size = 0;
+	if (bits == 1 || bits == 4 || bits == 8) {
+		image.palette_size = colors == 0 ? 1u << bits : colors;
+		image.palette = data + 14 + header_size;
+		if (compression != 0 || image.palette_size > 1u << bits || image.palette_size * 4 > size - 14 - header_size) {
+			throw error("unsupported BMP palette");
+		}
+	} else if (bits == 24 && compression == 0) {
+	} else if (bits == 32 && compression == 0) {
+	} else if (bits == 32 && compression == 3 && header_size >= 56) {
+		// Only the layout a BGRA image stores.
+		if (u32(54) != 0x00ff0000 || u32(58) != 0x0000ff00 || u32(62) != 0x000000ff) {
+			throw error("unsupported BMP bit fields");
+		}
+		image.alpha = u32(66) == 0xff000000;
+	} else {
+		throw error("unsupported BMP format: %u bits, compression %u", bits, compression);
+	}
+	image.stride = (uint64_t(image.width) * bits + 31) / 32 * 4;
+	if (pixel_offset > size || image.stride * image.height > size - pixel_offset) {
+		throw error("truncated BMP image");
+	}
+	image.pixels = data + pixel_offset;
+	return image;
+}
+
+// Runs conversions on a fixed set of threads.  The queue is bounded, so
+// that decoders wait rather than pile up bitmaps faster than they are
+// encoded, and buffers come back for reuse once encoded.
+struct encoder_pool_impl final : image_encoder {
+	using convert = void (*)(const std::string & filename, const std::vector<uint8_t> & bitmap);
+
+	struct job {
+		std::string filename;
+		std::vector<uint8_t> bitmap;
+		memory_lease lease;
+	};
+
+	const char * m_extension;
+	convert m_convert;
+	size_t m_limit;
+	std::mutex m_mutex;
+	std::condition_variable m_ready;
+	std::condition_variable m_space;
+	std::deque<job> m_jobs;
+	std::vector<std::vector<uint8_t>> m_buffers;
+	size_t m_failures;
+	bool m_finished;
+	std::vector<std::thread> m_threads;
+
+	inline encoder_pool_impl(const char * extension, const convert convert, const size_t threads)
+	: m_extension(extension)
+	, m_convert(convert)
+	, m_limit(2 * std::max<size_t>(threads, 1))
+	, m_failures(0)
+	, m_finished(false) {
+		for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+			m_threads.emplace_back([this] { work(); });
+		}
+	}
+
+	~encoder_pool_impl() noexcept {
+		finish();
+	}
+
+	const char * extension() const noexcept override {
+		return m_extension;
+	}
+
+	std::vector<uint8_t> acquire() override {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_buffers.empty()) {
+			return std::vector<uint8_t>{};
+		}
+		auto buffer = std::move(m_buffers.back());
+		m_buffers.pop_back();
+		return buffer;
+	}
+
+	void add(const std::string & filename, std::vector<uint8_t> bitmap, memory_lease lease) override {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_space.wait(lock, [this] { return m_jobs.size() < m_limit; });
+		m_jobs.push_back(job{filename, std::move(bitmap), std::move(lease)});
+		m_ready.notify_one();
+	}
+
+	void work() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;) {
+			m_ready.wait(lock, [this] { return !m_jobs.empty() || m_finished; });
+			if (m_jobs.empty()) {
+				return;
+			}
+			auto next = std::move(m_jobs.front());
+			m_jobs.pop_front();
+			m_space.notify_one();
+			lock.unlock();
+			try {
+				m_convert(next.filename, next.bitmap);
+				lock.lock();
+			} catch (const std::exception & e) {
+				lock.lock();
+				fprintf(stderr, "%s: %s\n", next.filename.c_str(), e.what());
+				++m_failures;
+			}
+			if (m_buffers.size() < m_limit + m_threads.size() && next.bitmap.capacity() <= retained_buffer_size) {
+				next.bitmap.clear();
+				m_buffers.push_back(std::move(next.bitmap));
+			}
+		}
+	}
+
+	size_t finish() override {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_finished = true;
+			m_ready.notify_all();
+		}
+		for (auto & thread : m_threads) {
+			if (thread.joinable()) {
+				thread.join();
+			}
+		}
+		return m_failures;
+	}
+};
+
+#if defined(RISCONVERT_PNG)
+
+// libpng reports errors by longjmp; they are caught at the setjmp in
+// write_png() and turned back into exceptions there.  A failed write keeps
+// its exception to rethrow, since longjmp must not leave a catch block.
+struct png_writer {
+	png_structp m_png;
+	png_infop m_info;
+	obufstream * m_output;
+	std::string m_error;
+	std::exception_ptr m_exception;
+
+	inline png_writer()
+	: m_png(png_create_write_struct(PNG_LIBPNG_VER_STRING, this, fail, warn))
+	, m_info(m_png != nullptr ? png_create_info_struct(m_png) : nullptr)
+	, m_output(nullptr) {
+		if (m_info == nullptr) {
+			png_destroy_write_struct(&m_png, nullptr);
+			throw std::bad_alloc{};
+		}
+	}
+
+	~png_writer() noexcept {
+		png_destroy_write_struct(&m_png, &m_info);
+	}
+
+	static void fail(png_structp png, const png_const_charp message) {
+		static_cast<png_writer *>(png_get_error_ptr(png))->m_error = message;
+		png_longjmp(png, 1);
+	}
+
+	static void warn(png_structp, png_const_charp) {
+	}
+
+	static void write(png_structp png, png_bytep data, const png_size_t length) {
+		auto & writer = *static_cast<png_writer *>(png_get_io_ptr(png));
+		try {
+			writer.m_output->write(data, length);
+		} catch (...) {
+			writer.m_exception = std::current_exception();
+		}
+		if (writer.m_exception) {
+			png_error(png, "write failed");
+		}
+	}
+
+	static void flush(png_structp) {
+	}
+};
+
+void write_png(const std::string & filename, const std::vector<uint8_t> & bitmap) {
+	const auto image = parse_bmp(bitmap.data(), bitmap.size());
+	std::vector<png_color> palette(image.palette_size);
+	for (size_t i = 0; i < palette.size(); ++i) {
+		palette[i].blue = image.palette[4 * i];
+		palette[i].green = image.palette[4 * i + 1];
+		palette[i].red = image.palette[4 * i + 2];
+	}
+	std::vector<png_bytep> rows(image.height);
+	for (size_t y = 0; y < rows.size(); ++y) {
+		const auto row = image.top_down ? y : rows.size() - 1 - y;
+		rows[y] = const_cast<png_bytep>(image.pixels + row * image.stride);
+	}
+	png_writer writer;
+	const auto output = obufstream::create(filename, 0);
+	writer.m_output = output.get();
+	if (setjmp(png_jmpbuf(writer.m_png))) {
+		::unlink(filename.c_str());
+		if (writer.m_exception) {
+			std::rethrow_exception(writer.m_exception);
+		}
+		throw error("%s", writer.m_error.c_str());
+	}
+	png_set_write_fn(writer.m_png, &writer, png_writer::write, png_writer::flush);
+	if (image.palette != nullptr) {
+		png_set_IHDR(writer.m_png, writer.m_info, image.width, image.height, image.bits,
+			PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		png_set_PLTE(writer.m_png, writer.m_info, palette.data(), palette.size());
+	} else {
+		const auto type = image.alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
+		png_set_IHDR(writer.m_png, writer.m_info, image.width, image.height, 8,
+			type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	}
+	png_write_info(writer.m_png, writer.m_info);
+	if (image.palette == nullptr) {
+		png_set_bgr(writer.m_png);
+		if (image.bits == 32 && !image.alpha) {
+			png_set_filler(writer.m_png, 0, PNG_FILLER_AFTER);
+		}
+	}
+	png_write_image(writer.m_png, rows.data());
+	png_write_end(writer.m_png, nullptr);
+	output->flush();
+}
+
+std::unique_ptr<image_encoder> image_encoder::png(const size_t threads) {
+	return std::unique_ptr<image_encoder>(new encoder_pool_impl(".png", write_png, threads));
+}
+
+#else
+
+std::unique_ptr<image_encoder> image_encoder::png(size_t) {
+	throw error("built without PNG support");
+}
+
+#endif
+
+bool is_bitmap_list(const std::array<char, 8> & magic) noexcept {
+	return memcmp(&magic, "LMDBML30", sizeof(magic)) == 0;
+}
+
+void extract_entry(
+	ibufstream & stream,
+	bitmap_names & names,
+	const size_t index,
+	const size_t offset,
+	const extract_options & options,
+	const size_t end
+) {
+	stream.seek(offset);
+	const auto type = stream.read<uint8_t>();
+	if (type == 8) {
+		export_plain_bitmap(stream, names, index, options, offset, end);
+	} else if (type == 9) {
+		export_compressed_bitmap(stream, names, index, options, offset, end);
+	} else {
+		throw error("unknown type: %u", type);
+	}
+}
+
+std::string index_filename(const std::string & archive_filename) {
+	return archive_filename + ".idx";
+}
+
+// The most entries an offsets table can list and still end where a 32-bit
+// offset can point.
+size_t offsets_limit(const size_t header_size) noexcept {
+	return (UINT32_MAX - header_size) / sizeof(uint32_t);
+}
+
+bool read_offsets(istream & stream, std::vector<uint32_t> & offsets, const size_t limit) {
+	const auto version = stream.read<uint8_t>();
+	if (version == 8) {
+		const auto magic = stream.read<std::array<char,8>>();
+		if (is_bitmap_list(magic)) {
+			const auto count = stream.read<uint32_t>();
+			if (count > std::min(limit, offsets_limit(1 + 8 + 4))) {
+				throw error("offsets table of %u entries is too large", count);
+			}
+			// Grown as it is read, so that a count the input cannot back
+			// costs no more memory than the bytes it does hold.
+			constexpr size_t block = 16 * 1024;
+			offsets.clear();
+			while (offsets.size() < count) {
+				const auto done = offsets.size();
+				offsets.resize(done + std::min<size_t>(count - done, block));
+				stream.read(offsets.data() + done, (offsets.size() - done) * sizeof(uint32_t));
+			}
+			return true;
+		} else {
+			return false;
+		}
+	} else {
+		throw error("unknown version: %u", version);
+	}
+}
+
+// Reads the header of the entry at offset and leaves the stream at its
+// data when the type is known.
+archive_entry read_entry(ibufstream & stream, const uint32_t offset) {
+	archive_entry entry;
+	entry.offset = offset;
+	stream.seek(offset);
+	entry.type = stream.read<uint8_t>();
+	entry.size1 = 0;
+	entry.size2 = 0;
+	if (entry.type == 8) {
+		entry.size1 = stream.read<uint32_t>();
+	} else if (entry.type == 9) {
+		entry.size1 = stream.read<uint32_t>();
+		entry.size2 = stream.read<uint32_t>();
+		stream.read<uint8_t>();
+	}
+	return entry;
+}
+
+std::vector<archive_entry> scan_entries(ibufstream & stream, const std::vector<uint32_t> & offsets) {
+	std::vector<archive_entry> entries(offsets.size());
+	for (size_t i = 0; i < offsets.size(); ++i) {
+		entries[i] = read_entry(stream, offsets[i]);
+	}
+	return entries;
+}
+
+// Where the entry at offset ends: where the next one up in sorted begins,
+// or at size for the last one.
+size_t entry_end(const std::vector<uint32_t> & sorted, const uint32_t offset, const size_t size) noexcept {
+	const auto next = std::upper_bound(sorted.begin(), sorted.end(), offset);
+	return next == sorted.end() ? size : *next;
+}
+
+// How many bytes the payload of entry may take up before end, where the
+// entry ends, or SIZE_MAX when that is not known.  Fails when the header,
+// or the payload of a plain entry, already runs past it.
+size_t payload_limit(const archive_entry & entry, const size_t end) {
+	if (end == SIZE_MAX) {
+		return SIZE_MAX;
+	}
+	const size_t data = entry.offset + (entry.type == 9 ? 1 + 4 + 4 + 1 : 1 + 4);
+	if (data > end) {
+		throw error("header runs past the end of the entry");
+	} else if (entry.type == 8 && entry.size1 > end - data) {
+		throw error("%u bytes run past the end of the entry", entry.size1);
+	}
+	return end - data;
+}
+
+// A sidecar index starts with its magic and the size and modification time
+// of the archive it was made from, so that a stale one is never used.
+struct index_header {
+	std::array<char, 8> magic;
+	uint64_t size;
+	int64_t seconds;
+	int64_t nanoseconds;
+	uint32_t count;
+
+	static constexpr std::array<char, 8> expected_magic{{'R', 'I', 'S', 'I', 'D', 'X', '0', '1'}};
+
+	bool stamp(const std::string & archive_filename) {
+		struct stat st;
+		if (archive_filename == "-" || ::stat(archive_filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+			return false;
+		}
+		magic = expected_magic;
+		size = st.st_size;
+		seconds = st.st_mtim.tv_sec;
+		nanoseconds = st.st_mtim.tv_nsec;
+		return true;
+	}
+
+	bool matches(const index_header & other) const noexcept {
+		return magic == other.magic && size == other.size && seconds == other.seconds && nanoseconds == other.nanoseconds;
+	}
+
+	void read(istream & stream) {
+		stream.read(magic);
+		stream.read(size);
+		stream.read(seconds);
+		stream.read(nanoseconds);
+		stream.read(count);
+	}
+
+	void write(ostream & stream) const {
+		stream.write(magic);
+		stream.write(size);
+		stream.write(seconds);
+		stream.write(nanoseconds);
+		stream.write(count);
+	}
+};
+
+constexpr std::array<char, 8> index_header::expected_magic;
+
+bool load_index(const std::string & archive_filename, std::vector<archive_entry> & entries) {
+	index_header expected;
+	if (!expected.stamp(archive_filename)) {
+		return false;
+	}
+	std::unique_ptr<ibufstream> stream;
+	try {
+		stream = ibufstream::open(index_filename(archive_filename));
+	} catch (const std::system_error & e) {
+		if (e.code() == std::errc::no_such_file_or_directory) {
+			return false;
+		}
+		throw;
+	}
+	index_header header;
+	header.read(*stream);
+	if (!header.matches(expected)) {
+		return false;
+	}
+	entries.clear();
+	for (uint32_t i = 0; i < header.count; ++i) {
+		archive_entry entry;
+		stream->read(entry.offset);
+		stream->read(entry.type);
+		stream->read(entry.size1);
+		stream->read(entry.size2);
+		entries.push_back(entry);
+	}
+	return true;
+}
+
+// Written under a temporary name and renamed into place, so readers see
+// either the old index or the complete new one.
+void save_index(const std::string & archive_filename, const std::vector<archive_entry> & entries) {
+	index_header header;
+	if (!header.stamp(archive_filename)) {
+		return;
+	}
+	header.count = entries.size();
+	const auto filename = index_filename(archive_filename);
+	const auto temporary = filename + ".tmp";
+	try {
+		const auto output = obufstream::create(temporary, 0);
+		header.write(*output);
+		for (const auto & entry : entries) {
+			output->write(entry.offset);
+			output->write(entry.type);
+			output->write(entry.size1);
+			output->write(entry.size2);
+		}
+		output->flush();
+	} catch (...) {
+		::unlink(temporary.c_str());
+		throw;
+	}
+	if (::rename(temporary.c_str(), filename.c_str()) != 0) {
+		const auto saved = errno;
+		::unlink(temporary.c_str());
+		throw std::system_error(saved, std::system_category());
+	}
+}
+
+// The decoded bitmap of one entry, cut off at its size.
+struct ientrystream_impl final : istream {
+	std::unique_ptr<ilzrwstream> m_decoder;
+	istream & m_stream;
+	size_t m_remaining;
+
+	inline ientrystream_impl(std::unique_ptr<ilzrwstream> decoder, const size_t size)
+	: m_decoder(std::move(decoder))
+	, m_stream(*m_decoder)
+	, m_remaining(size)
+	{}
+
+	inline ientrystream_impl(istream & stream, const size_t size)
+	: m_stream(stream)
+	, m_remaining(size)
+	{}
+
+	size_t try_read(void * buffer, const size_t amount) override {
+		const auto len = m_stream.try_read(buffer, std::min(amount, m_remaining));
+		m_remaining -= len;
+		return len;
+	}
+};
+
+// Decodes the whole bitmap of entry, which ends at end, to data from the
+// stream as read_entry() left it.
+void decode_entry(ibufstream & stream, const archive_entry & entry, uint8_t * data, const size_t end) {
+	const auto limit = payload_limit(entry, end);
+	if (entry.type == 8) {
+		stream.read(data, entry.size1);
+	} else {
+		lzrw_decoder decoder;
+		block_cursor<ibufstream> cursor(stream, limit);
+		const auto done = decoder.decode(cursor, data, entry.size1);
+		if (done < entry.size1) {
+			throw error("payload ends after %zu of %u bytes", done, entry.size1);
+		}
+		decoder.record();
+	}
+}
+
+// Each entry is decoded from no more than the bytes up to the next one; the
+// last one is only held to the size of the archive when that is known.
+struct archive_impl final : archive {
+	std::unique_ptr<ibufstream> m_file;
+	ibufstream & m_stream;
+	size_t m_size;
+	std::vector<uint32_t> m_offsets;
+	std::vector<uint32_t> m_sorted;
+
+	inline archive_impl(std::unique_ptr<ibufstream> file, const size_t size)
+	: m_file(std::move(file))
+	, m_stream(*m_file)
+	, m_size(size)
+	{}
+
+	inline explicit archive_impl(ibufstream & stream)
+	: m_stream(stream)
+	, m_size(SIZE_MAX)
+	{}
+
+	void open() {
+		if (!m_stream.seekable()) {
+			throw std::system_error(ESPIPE, std::system_category());
+		}
+		read_offsets(m_stream, m_offsets);
+		m_sorted = m_offsets;
+		std::sort(m_sorted.begin(), m_sorted.end());
+	}
+
+	size_t end(const size_t index) const noexcept {
+		return entry_end(m_sorted, m_offsets[index], m_size);
+	}
+
+	size_t size() const noexcept override {
+		return m_offsets.size();
+	}
+
+	archive_entry entry(const size_t index) override {
+		if (index >= m_offsets.size()) {
+			throw error("no entry %zu", index);
+		}
+		return read_entry(m_stream, m_offsets[index]);
+	}
+
+	std::unique_ptr<istream> open_entry(const size_t index) override {
+		const auto entry = this->entry(index);
+		if (entry.type == 8) {
+			payload_limit(entry, end(index));
+			return std::unique_ptr<istream>(new ientrystream_impl(m_stream, entry.size1));
+		} else if (entry.type == 9) {
+			std::unique_ptr<ilzrwstream> decoder(new ilzrwstream_impl(m_stream, payload_limit(entry, end(index))));
+			return std::unique_ptr<istream>(new ientrystream_impl(std::move(decoder), entry.size1));
+		} else {
+			throw error("unknown type: %u", entry.type);
+		}
+	}
+
+	size_t decode(const size_t index, void * buffer, const size_t capacity) override {
+		const auto entry = this->entry(index);
+		if (entry.type != 8 && entry.type != 9) {
+			throw error("unknown type: %u", entry.type);
+		} else if (entry.size1 > capacity) {
+			throw error("entry %zu needs %u bytes", index, entry.size1);
+		}
+		decode_entry(m_stream, entry, static_cast<uint8_t *>(buffer), end(index));
+		return entry.size1;
+	}
+
+	size_t decode_slice(const size_t index, lzrw_state & state, void * buffer, const size_t capacity) override {
+		const auto entry = this->entry(index);
+		const auto data = static_cast<uint8_t *>(buffer);
+		if (entry.type != 8 && entry.type != 9) {
+			throw error("unknown type: %u", entry.type);
+		} else if (state.output > entry.size1) {
+			throw error("entry %zu has only %u bytes", index, entry.size1);
+		} else if (state.window_index >= sizeof(state.window) || state.control_remaining > 16 || state.match_remaining > 16 || (state.match_remaining > 0 && (state.match_distance == 0 || state.match_distance > sizeof(state.window)))) {
+			throw error("invalid decoder state");
+		}
+		const auto amount = std::min<size_t>(capacity, entry.size1 - state.output);
+		const auto limit = payload_limit(entry, end(index));
+		if (amount == 0) {
+			return 0;
+		} else if (state.input > limit) {
+			throw error("invalid decoder state");
+		} else if (entry.type == 8) {
+			m_stream.seek(entry.offset + 1 + 4 + state.output);
+			m_stream.read(data, amount);
+			state.input += amount;
+		} else {
+			if (state.input > 0) {
+				m_stream.seek(entry.offset + 1 + 4 + 4 + 1 + state.input);
+			}
+			lzrw_decoder decoder;
+			decoder.restore(state);
+			block_cursor<ibufstream> cursor(m_stream, limit == SIZE_MAX ? SIZE_MAX : limit - state.input);
+			const auto done = decoder.decode(cursor, data, amount);
+			if (done < amount) {
+				throw error("payload ends after %zu of %u bytes", size_t(state.output + done), entry.size1);
+			}
+			decoder.record();
+			decoder.save(state);
+			state.input += cursor.consumed();
+		}
+		state.output += amount;
+		return amount;
+	}
+};
+
+std::unique_ptr<archive> archive::open(const std::string & filename) {
+	struct stat st;
+	if (::stat(filename.c_str(), &st) != 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	const auto size = S_ISREG(st.st_mode) ? size_t(st.st_size) : SIZE_MAX;
+	std::unique_ptr<archive_impl> result(new archive_impl(ibufstream::open(filename), size));
+	result->open();
+	return result;
+}
+
+std::unique_ptr<archive> archive::wrap(ibufstream & stream) {
+	std::unique_ptr<archive_impl> result(new archive_impl(stream));
+	result->open();
+	return result;
+}
+
+// Reads from the bytes handed to one feed() without waiting for more; a
+// token cut off at their end is left for the next one.
+struct push_cursor {
+	const uint8_t * m_pos;
+	const uint8_t * m_end;
+
+	inline push_cursor(const uint8_t * begin, const uint8_t * end) noexcept
+	: m_pos(begin)
+	, m_end(end)
+	{}
+
+	inline size_t available() const noexcept {
+		return m_end - m_pos;
+	}
+
+	inline bool ready(const size_t amount) const noexcept {
+		return available() >= amount;
+	}
+
+	inline uint8_t byte() noexcept {
+		return *m_pos++;
+	}
+
+	inline bool word(uint16_t & value) noexcept {
+		value = m_pos[0] | (m_pos[1] << 8);
+		m_pos += 2;
+		return true;
+	}
+};
+
+// Gathers the archive header, the offsets table and each entry header in
+// m_pending, and hands bitmap bytes to the handler as they come.
+struct archive_parser_impl final : archive_parser {
+	enum class phase { header, offsets, skip, entry, plain, compressed, done };
+
+	static constexpr size_t archive_header_size = 1 + 8 + 4;
+	static constexpr size_t output_size = 64 * 1024;
+
+	archive_handler & m_handler;
+	std::vector<entry_range> m_ranges;
+	phase m_phase;
+	uint64_t m_offset;
+	std::vector<uint8_t> m_pending;
+	size_t m_need;
+	std::vector<uint32_t> m_offsets;
+	std::vector<uint32_t> m_sorted;
+	std::vector<size_t> m_order;
+	size_t m_next;
+	archive_entry m_entry;
+	// Where the entry in hand ends, as far as the offsets table tells.
+	uint64_t m_end;
+	uint64_t m_left;
+	lzrw_decoder m_decoder;
+	// At most one byte is ever left over, but the next feed() is copied in
+	// behind it to pass the decoder a whole token.
+	std::array<uint8_t, 64> m_carry;
+	size_t m_carried;
+	std::unique_ptr<uint8_t[]> m_output;
+
+	inline archive_parser_impl(archive_handler & handler, const std::vector<entry_range> & entries)
+	: m_handler(handler)
+	, m_ranges(entries)
+	, m_phase(phase::header)
+	, m_offset(0)
+	, m_need(archive_header_size)
+	, m_next(0)
+	, m_entry{}
+	, m_end(0)
+	, m_left(0)
+	, m_carried(0)
+	, m_output(new uint8_t[output_size])
+	{}
+
+	~archive_parser_impl() noexcept {
+		m_decoder.record();
+	}
+
+	void feed(const void * data, const size_t size) override {
+		auto in = static_cast<const uint8_t *>(data);
+		const auto end = in + size;
+		while (in < end && m_phase != phase::done) {
+			if (m_phase == phase::header || m_phase == phase::offsets || m_phase == phase::entry) {
+				const auto len = std::min<size_t>(m_need - m_pending.size(), end - in);
+				m_pending.insert(m_pending.end(), in, in + len);
+				in += len;
+				m_offset += len;
+				if (m_pending.size() == m_need) {
+					gathered();
+				}
+			} else if (m_phase == phase::skip) {
+				const auto len = std::min<uint64_t>(m_offsets[m_order[m_next]] - m_offset, end - in);
+				in += len;
+				m_offset += len;
+				arrive();
+			} else if (m_phase == phase::plain) {
+				const auto len = std::min<uint64_t>(m_left, end - in);
+				m_handler.entry_data(m_order[m_next], in, len);
+				in += len;
+				m_offset += len;
+				m_left -= len;
+				if (m_left == 0) {
+					next();
+				}
+			} else {
+				const auto used = decompress(in, in + std::min<uint64_t>(end - in, m_end - m_offset));
+				in += used;
+				m_offset += used;
+				if (m_phase == phase::compressed && m_offset == m_end) {
+					throw error("entry %zu: payload ends after %llu of %u bytes", m_order[m_next], (unsigned long long) (m_entry.size1 - m_left), m_entry.size1);
+				}
+			}
+		}
+	}
+
+	uint64_t wanted() const noexcept override {
+		return m_phase == phase::skip ? m_offsets[m_order[m_next]] : m_offset;
+	}
+
+	void skip(const uint64_t offset) override {
+		if (offset < m_offset || offset > wanted()) {
+			throw error("cannot skip from %llu to %llu", (unsigned long long) m_offset, (unsigned long long) offset);
+		}
+		m_offset = offset;
+		if (m_phase == phase::skip) {
+			arrive();
+		}
+	}
+
+	bool done() const noexcept override {
+		return m_phase == phase::done;
+	}
+
+	void finish() override {
+		if (m_phase != phase::done) {
+			throw end_of_stream{};
+		}
+	}
+
+	// Acts on m_pending once it holds m_need bytes.
+	void gathered() {
+		const auto data = m_pending.data();
+		if (m_phase == phase::header) {
+			if (data[0] != 8) {
+				throw error("unknown version: %u", data[0]);
+			}
+			std::array<char, 8> magic;
+			memcpy(magic.data(), data + 1, magic.size());
+			if (!is_bitmap_list(magic)) {
+				m_handler.begin_archive(0);
+				m_phase = phase::done;
+				return;
+			}
+			uint32_t count;
+			memcpy(&count, data + 1 + 8, sizeof(count));
+			if (count > offsets_limit(archive_header_size)) {
+				throw error("offsets table of %u entries is too large", count);
+			}
+			// m_pending only grows as the table arrives.
+			m_phase = phase::offsets;
+			m_need = archive_header_size + size_t(count) * sizeof(uint32_t);
+			if (m_need == archive_header_size) {
+				gathered();
+			}
+		} else if (m_phase == phase::offsets) {
+			m_offsets.resize((m_need - archive_header_size) / sizeof(uint32_t));
+			memcpy(m_offsets.data(), data + archive_header_size, m_offsets.size() * sizeof(uint32_t));
+			m_pending = std::vector<uint8_t>{};
+			m_sorted = m_offsets;
+			std::sort(m_sorted.begin(), m_sorted.end());
+			select();
+			m_handler.begin_archive(m_offsets.size());
+			m_next = SIZE_MAX;
+			next();
+		} else if (m_need == 1 + 4 && data[0] == 9) {
+			m_need = 1 + 4 + 4 + 1;
+		} else if (data[0] != 8 && data[0] != 9) {
+			throw error("entry %zu: unknown type: %u", m_order[m_next], data[0]);
+		} else {
+			m_entry.offset = m_offsets[m_order[m_next]];
+			m_entry.type = data[0];
+			memcpy(&m_entry.size1, data + 1, sizeof(m_entry.size1));
+			m_entry.size2 = 0;
+			if (m_entry.type == 9) {
+				memcpy(&m_entry.size2, data + 1 + 4, sizeof(m_entry.size2));
+				m_decoder = lzrw_decoder{};
+				m_carried = 0;
+			}
+			try {
+				payload_limit(m_entry, m_end);
+			} catch (const std::exception & e) {
+				throw error("entry %zu: %s", m_order[m_next], e.what());
+			}
+			m_left = m_entry.size1;
+			m_handler.begin_entry(m_order[m_next], m_entry);
+			m_phase = m_entry.type == 8 ? phase::plain : phase::compressed;
+			if (m_left == 0) {
+				next();
+			}
+		}
+	}
+
+	void select() {
+		std::vector<size_t> indices;
+		for (const auto & range : m_ranges) {
+			const auto last = range.last == SIZE_MAX ? m_offsets.size() - 1 : range.last;
+			if (range.first >= m_offsets.size()) {
+				throw error("no entry %zu", range.first);
+			} else if (last >= m_offsets.size()) {
+				throw error("no entry %zu", last);
+			}
+			for (size_t i = range.first; i <= last; ++i) {
+				indices.push_back(i);
+			}
+		}
+		if (m_ranges.empty()) {
+			indices.resize(m_offsets.size());
+			for (size_t i = 0; i < indices.size(); ++i) {
+				indices[i] = i;
+			}
+		}
+		std::sort(indices.begin(), indices.end());
+		indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+		const auto & offsets = m_offsets;
+		std::stable_sort(indices.begin(), indices.end(), [&offsets](const size_t a, const size_t b) {
+			return offsets[a] < offsets[b];
+		});
+		m_order = std::move(indices);
+	}
+
+	// Ends the entry in hand, if any, and heads for the next one.
+	void next() {
+		if (m_next != SIZE_MAX) {
+			m_handler.end_entry(m_order[m_next]);
+			if (m_entry.type == 9) {
+				m_decoder.record();
+			}
+		}
+		++m_next;
+		if (m_next == m_order.size()) {
+			m_phase = phase::done;
+			return;
+		}
+		const auto index = m_order[m_next];
+		if (m_offsets[index] < m_offset) {
+			throw error("entry %zu: offset %u is behind the stream", index, m_offsets[index]);
+		}
+		m_phase = phase::skip;
+		arrive();
+	}
+
+	// Starts on the entry header once the skip reaches it.
+	void arrive() {
+		if (m_offset == m_offsets[m_order[m_next]]) {
+			m_end = entry_end(m_sorted, m_offset, SIZE_MAX);
+			m_pending.clear();
+			m_need = 1 + 4;
+			m_phase = phase::entry;
+		}
+	}
+
+	// Decodes what it can of [in, end), through m_carry when a token was
+	// cut off last time, and returns how much of it was used.
+	size_t decompress(const uint8_t * in, const uint8_t * end) {
+		size_t used = 0;
+		if (m_carried > 0) {
+			const auto len = std::min<size_t>(m_carry.size() - m_carried, end - in);
+			memcpy(m_carry.data() + m_carried, in, len);
+			push_cursor cursor(m_carry.data(), m_carry.data() + m_carried + len);
+			decode(cursor);
+			const size_t consumed = cursor.m_pos - m_carry.data();
+			if (consumed < m_carried) {
+				m_carried += len;
+				return len;
+			}
+			used = consumed - m_carried;
+			m_carried = 0;
+			if (m_phase != phase::compressed) {
+				return used;
+			}
+		}
+		push_cursor cursor(in + used, end);
+		decode(cursor);
+		used = cursor.m_pos - in;
+		if (m_phase == phase::compressed) {
+			m_carried = end - cursor.m_pos;
+			memcpy(m_carry.data(), cursor.m_pos, m_carried);
+			used = end - in;
+		}
+		return used;
+	}
+
+	void decode(push_cursor & cursor) {
+		while (m_left > 0) {
+			const auto amount = std::min<uint64_t>(m_left, output_size);
+			const auto produced = m_decoder.decode(cursor, m_output.get(), amount);
+			if (produced > 0) {
+				m_handler.entry_data(m_order[m_next], m_output.get(), produced);
+				m_left -= produced;
+			}
+			if (produced < amount) {
+				return;
+			}
+		}
+		next();
+	}
+};
+
+constexpr size_t archive_parser_impl::archive_header_size;
+constexpr size_t archive_parser_impl::output_size;
+
+std::unique_ptr<archive_parser> archive_parser::create(archive_handler & handler, const std::vector<entry_range> & entries) {
+	return std::unique_ptr<archive_parser>(new archive_parser_impl(handler, entries));
+}
+
+// Writes the header with a blank offsets table, which finish() fills in
+// once every entry has been placed.
+struct archive_writer_impl final : archive_writer {
+	std::unique_ptr<ofstream> m_file;
+	std::unique_ptr<obufstream> m_stream;
+	std::vector<uint32_t> m_offsets;
+	size_t m_count;
+	size_t m_offset;
+
+	inline archive_writer_impl(std::unique_ptr<ofstream> file, const size_t count)
+	: m_file(std::move(file))
+	, m_stream(obufstream::wrap(*m_file))
+	, m_count(count)
+	, m_offset(1 + 8 + 4 + count * sizeof(uint32_t))
+	{
+		if (count > UINT32_MAX) {
+			throw error("too many entries: %zu", count);
+		}
+		m_offsets.reserve(count);
+		m_stream->write(uint8_t(8));
+		m_stream->write(std::array<char, 8>{{'L', 'M', 'D', 'B', 'M', 'L', '3', '0'}});
+		m_stream->write(uint32_t(count));
+		const std::vector<uint32_t> blank(count);
+		m_stream->write(blank.data(), count * sizeof(uint32_t));
+	}
+
+	// Records where the next entry goes, which must be within reach of a
+	// 32-bit offset.
+	void place(const size_t size) {
+		if (m_offsets.size() == m_count) {
+			throw error("more than %zu entries", m_count);
+		} else if (m_offset > UINT32_MAX || size > UINT32_MAX) {
+			throw error("archive too large");
+		}
+		m_offsets.push_back(uint32_t(m_offset));
+		m_offset += size;
+	}
+
+	void add(const void * data, const size_t size) override {
+		place(1 + 4 + size);
+		m_stream->write(uint8_t(8));
+		m_stream->write(uint32_t(size));
+		m_stream->write(data, size);
+	}
+
+	void add_compressed(const size_t size, const void * compressed, const size_t compressed_size) override {
+		if (size > UINT32_MAX || compressed_size > UINT32_MAX) {
+			throw error("entry too large");
+		}
+		place(1 + 4 + 4 + 1 + compressed_size);
+		m_stream->write(uint8_t(9));
+		m_stream->write(uint32_t(size));
+		m_stream->write(uint32_t(compressed_size));
+		m_stream->write(uint8_t(0));
+		m_stream->write(compressed, compressed_size);
+	}
+
+	void finish() override {
+		if (m_offsets.size() != m_count) {
+			throw error("%zu of %zu entries added", m_offsets.size(), m_count);
+		}
+		m_stream->seek(1 + 8 + 4);
+		m_stream->write(m_offsets.data(), m_count * sizeof(uint32_t));
+		m_stream->flush();
+	}
+};
+
+std::unique_ptr<archive_writer> archive_writer::create(const std::string & filename, const size_t count) {
+	return std::unique_ptr<archive_writer>(new archive_writer_impl(ofstream::create(filename), count));
+}
+
+// Reads all of a file into data.
+void read_file(const std::string & filename, std::vector<uint8_t> & data) {
+	const auto stream = ibufstream::open(filename);
+	data.clear();
+	const uint8_t * block;
+	while (const auto available = stream->peek(block)) {
+		data.insert(data.end(), block, block + available);
+		stream->consume(available);
+	}
+}
+
+// Reads and compresses entries on worker threads, at most window of them
+// ahead of the writer, which stores them in order.
+struct packer {
+	struct slot {
+		std::vector<uint8_t> raw;
+		std::vector<uint8_t> compressed;
+		std::string error;
+		bool ready = false;
+	};
+
+	const std::vector<std::string> & m_filenames;
+	const bool m_compress;
+	std::vector<slot> m_slots;
+	size_t m_next;
+	size_t m_written;
+	bool m_stopped;
+	std::mutex m_mutex;
+	std::condition_variable m_ready;
+	std::condition_variable m_space;
+	std::vector<std::thread> m_threads;
+
+	inline packer(const std::vector<std::string> & filenames, const size_t jobs, const bool compress)
+	: m_filenames(filenames)
+	, m_compress(compress)
+	, m_slots(2 * jobs)
+	, m_next(0)
+	, m_written(0)
+	, m_stopped(false) {
+		for (size_t i = 0; i < jobs; ++i) {
+			m_threads.emplace_back([this] { work(); });
+		}
+	}
+
+	~packer() noexcept {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopped = true;
+		}
+		m_space.notify_all();
+		for (auto & thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	void work() {
+		for (;;) {
+			size_t index;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_space.wait(lock, [this] { return m_stopped || m_next < std::min(m_filenames.size(), m_written + m_slots.size()); });
+				if (m_stopped || m_next == m_filenames.size()) {
+					return;
+				}
+				index = m_next++;
+			}
+			// Nobody else touches the slot until it is marked ready.
+			auto & entry = m_slots[index % m_slots.size()];
+			try {
+				read_file(m_filenames[index], entry.raw);
+				entry.compressed.clear();
+				if (m_compress) {
+					lzrw_compress(entry.raw.data(), entry.raw.size(), entry.compressed);
+				}
+			} catch (const std::exception & e) {
+				entry.error = m_filenames[index] + ": " + e.what();
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				entry.ready = true;
+			}
+			m_ready.notify_all();
+		}
+	}
+
+	void write(archive_writer & writer) {
+		for (size_t i = 0; i < m_filenames.size(); ++i) {
+			auto & entry = m_slots[i % m_slots.size()];
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_ready.wait(lock, [&entry] { return entry.ready; });
+			}
+			if (!entry.error.empty()) {
+				throw std::runtime_error(entry.error);
+			} else if (m_compress && entry.compressed.size() + 4 + 1 < entry.raw.size()) {
+				writer.add_compressed(entry.raw.size(), entry.compressed.data(), entry.compressed.size());
+			} else {
+				writer.add(entry.raw.data(), entry.raw.size());
+			}
+			if (entry.raw.capacity() > retained_buffer_size) {
+				entry.raw = std::vector<uint8_t>{};
+				entry.compressed = std::vector<uint8_t>{};
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				entry.ready = false;
+				++m_written;
+			}
+			m_space.notify_all();
+		}
+		writer.finish();
+	}
+};
+
+void pack(
+	const std::string & archive_filename,
+	const std::vector<std::string> & input_filenames,
+	const size_t jobs,
+	const bool compress
+) {
+	const auto writer = archive_writer::create(archive_filename, input_filenames.size());
+	packer(input_filenames, std::max<size_t>(jobs, 1), compress).write(*writer);
+}
+
+// An archive kept mapped along with its offsets table, for as long as any
+// request is using it.
+struct mapped_archive {
+	int m_fd;
+	const uint8_t * m_data;
+	size_t m_size;
+	struct stat m_stat;
+	// Entry headers are read from the mapping when asked for, so that an
+	// archive costs the cache little more than its offsets table.
+	std::vector<uint32_t> m_offsets;
+	std::vector<uint32_t> m_sorted;
+
+	// Refuses an offsets table that would take more than header_bytes.
+	inline mapped_archive(const std::string & filename, const size_t header_bytes)
+	: m_fd(::open(filename.c_str(), O_RDONLY | O_CLOEXEC))
+	, m_data(nullptr)
+	, m_size(0) {
+		if (m_fd < 0) {
+			throw std::system_error(errno, std::system_category());
+		}
+		if (::fstat(m_fd, &m_stat) != 0) {
+			const auto error = errno;
+			::close(m_fd);
+			throw std::system_error(error, std::system_category());
+		}
+		m_size = m_stat.st_size;
+		if (m_size > 0) {
+			const auto data = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+			if (data == MAP_FAILED) {
+				const auto error = errno;
+				::close(m_fd);
+				throw std::system_error(error, std::system_category());
+			}
+			m_data = static_cast<const uint8_t *>(data);
+		}
+		try {
+			// The table has to fit in the file before anything is
+			// allocated for it.
+			const size_t header_size = 1 + 8 + 4;
+			const auto fits = m_size > header_size ? (m_size - header_size) / sizeof(uint32_t) : 0;
+			const auto stream = view();
+			read_offsets(*stream, m_offsets, std::min(fits, header_bytes / (2 * sizeof(uint32_t))));
+			m_sorted = m_offsets;
+			std::sort(m_sorted.begin(), m_sorted.end());
+		} catch (...) {
+			release();
+			throw;
+		}
+	}
+
+	mapped_archive(const mapped_archive &) = delete;
+	mapped_archive & operator=(const mapped_archive &) = delete;
+
+	~mapped_archive() noexcept {
+		release();
+	}
+
+	void release() noexcept {
+		if (m_data != nullptr) {
+			::munmap(const_cast<uint8_t *>(m_data), m_size);
+		}
+		::close(m_fd);
+	}
+
+	std::unique_ptr<ibufstream> view() const {
+		return ibufstream::view(m_data, m_size);
+	}
+
+	// Where the entry at index ends, which its decoding may not run past.
+	size_t end(const size_t index) const noexcept {
+		return entry_end(m_sorted, m_offsets[index], m_size);
+	}
+
+	// What the cache counts it as; the mapping itself is page cache.
+	size_t bytes() const noexcept {
+		return sizeof(*this) + (m_offsets.size() + m_sorted.size()) * sizeof(uint32_t);
+	}
+
+	// Whether the file at the path it was opened from is still this one.
+	bool current(const struct stat & st) const noexcept {
+		return st.st_dev == m_stat.st_dev && st.st_ino == m_stat.st_ino
+			&& st.st_size == m_stat.st_size
+			&& st.st_mtim.tv_sec == m_stat.st_mtim.tv_sec && st.st_mtim.tv_nsec == m_stat.st_mtim.tv_nsec;
+	}
+};
+
+// A map from keys to shared values, bounded by the bytes they are said to
+// take up and by their number, that drops the least recently used first.
+// Keys are spread over shards with a lock of their own.  The limits are
+// shared by all of them: an insert that goes over drops from its own shard
+// first and then from the others in turn, so one value may take up to the
+// whole limit.
+template<typename Value>
+struct sharded_cache {
+	static constexpr size_t shard_count = 16;
+
+	struct item {
+		std::string key;
+		std::shared_ptr<const Value> value;
+		size_t bytes;
+	};
+
+	struct shard {
+		std::mutex m_mutex;
+		std::list<item> m_recent;
+		std::unordered_map<std::string, typename std::list<item>::iterator> m_items;
+	};
+
+	std::array<shard, shard_count> m_shards;
+	size_t m_byte_limit;
+	size_t m_item_limit;
+	std::atomic<size_t> m_bytes;
+	std::atomic<size_t> m_items;
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+	std::atomic<uint64_t> m_evictions;
+
+	inline sharded_cache(const size_t bytes, const size_t items)
+	: m_byte_limit(bytes)
+	, m_item_limit(std::max<size_t>(items, 1))
+	, m_bytes(0)
+	, m_items(0)
+	, m_hits(0)
+	, m_misses(0)
+	, m_evictions(0)
+	{}
+
+	inline bool over() const noexcept {
+		return m_bytes > m_byte_limit || m_items > m_item_limit;
+	}
+
+	// Drops the least recently used item of shard, whose lock is held.
+	void evict(shard & shard) {
+		auto & last = shard.m_recent.back();
+		m_bytes -= last.bytes;
+		--m_items;
+		shard.m_items.erase(last.key);
+		shard.m_recent.pop_back();
+		++m_evictions;
+	}
+
+	inline shard & locate(const std::string & key) noexcept {
+		return m_shards[std::hash<std::string>()(key) % shard_count];
+	}
+
+	std::shared_ptr<const Value> find(const std::string & key) {
+		auto & shard = locate(key);
+		std::lock_guard<std::mutex> lock(shard.m_mutex);
+		const auto found = shard.m_items.find(key);
+		if (found == shard.m_items.end()) {
+			++m_misses;
+			return nullptr;
+		}
+		++m_hits;
+		shard.m_recent.splice(shard.m_recent.begin(), shard.m_recent, found->second);
+		return found->second->value;
+	}
+
+	// Replaces whatever key held.  A value larger than the whole limit is
+	// not kept at all.
+	void insert(const std::string & key, std::shared_ptr<const Value> value, const size_t bytes) {
+		auto & home = locate(key);
+		{
+			std::lock_guard<std::mutex> lock(home.m_mutex);
+			const auto found = home.m_items.find(key);
+			if (found != home.m_items.end()) {
+				m_bytes -= found->second->bytes;
+				--m_items;
+				home.m_recent.erase(found->second);
+				home.m_items.erase(found);
+			}
+			if (bytes > m_byte_limit) {
+				return;
+			}
+			home.m_recent.push_front(item{key, std::move(value), bytes});
+			home.m_items.emplace(key, home.m_recent.begin());
+			m_bytes += bytes;
+			++m_items;
+			while (over() && home.m_recent.size() > 1) {
+				evict(home);
+			}
+		}
+		// Only one lock is held at a time, so inserts into different
+		// shards cannot wait on each other.
+		const auto first = size_t(&home - m_shards.data());
+		for (size_t i = 1; over() && i < shard_count; ++i) {
+			auto & shard = m_shards[(first + i) % shard_count];
+			std::lock_guard<std::mutex> lock(shard.m_mutex);
+			while (over() && !shard.m_recent.empty()) {
+				evict(shard);
+			}
+		}
+	}
+
+	cache_counters counters() {
+		cache_counters result{};
+		result.hits = m_hits;
+		result.misses = m_misses;
+		result.evictions = m_evictions;
+		result.items = m_items;
+		result.bytes = m_bytes;
+		return result;
+	}
+};
+
+template<typename Value>
+constexpr size_t sharded_cache<Value>::shard_count;
+
+// Archives are keyed by path and checked against the file on every use;
+// bitmaps by the identity of the file they came from, so that those of a
+// replaced archive are never found again and simply age out.
+struct entry_cache_impl final : entry_cache {
+	sharded_cache<mapped_archive> m_archives;
+	sharded_cache<std::vector<uint8_t>> m_bitmaps;
+
+	inline entry_cache_impl(const size_t header_bytes, const size_t bitmap_bytes, const size_t max_open)
+	: m_archives(header_bytes, max_open)
+	, m_bitmaps(bitmap_bytes, SIZE_MAX)
+	{}
+
+	std::shared_ptr<const mapped_archive> open(const std::string & filename) {
+		struct stat st;
+		if (::stat(filename.c_str(), &st) != 0) {
+			throw std::system_error(errno, std::system_category());
+		} else if (!S_ISREG(st.st_mode)) {
+			// Opening a FIFO or device could block or never end.
+			throw error("not a regular file");
+		}
+		auto archive = m_archives.find(filename);
+		if (archive && archive->current(st)) {
+			return archive;
+		}
+		archive.reset(new mapped_archive(filename, m_archives.m_byte_limit));
+		m_archives.insert(filename, archive, archive->bytes());
+		return archive;
+	}
+
+	std::shared_ptr<const std::vector<uint8_t>> get(const std::string & filename, const size_t index) override {
+		const auto archive = open(filename);
+		if (index >= archive->m_offsets.size()) {
+			throw error("no entry %zu", index);
+		}
+		char key[96];
+		snprintf(key, sizeof(key), "%llu:%llu:%lld.%09ld:%zu",
+			(unsigned long long) archive->m_stat.st_dev, (unsigned long long) archive->m_stat.st_ino,
+			(long long) archive->m_stat.st_mtim.tv_sec, long(archive->m_stat.st_mtim.tv_nsec), index);
+		auto bitmap = m_bitmaps.find(key);
+		if (bitmap) {
+			return bitmap;
+		}
+		const auto stream = archive->view();
+		const auto entry = read_entry(*stream, archive->m_offsets[index]);
+		if (entry.type != 8 && entry.type != 9) {
+			throw error("unknown type: %u", entry.type);
+		}
+		// The size comes from the file, so it is checked before a buffer
+		// is sized to match: a plain entry must fit in its extent, and a
+		// compressed one cannot produce more than 8 bytes per byte of it.
+		const auto end = archive->end(index);
+		const auto limit = payload_limit(entry, end);
+		if (entry.type == 9 && entry.size1 / 8 > limit) {
+			throw error("entry %zu claims %u bytes, more than the archive holds", index, entry.size1);
+		} else if (entry.size1 > m_bitmaps.m_byte_limit) {
+			throw error("entry %zu of %u bytes is larger than the cache", index, entry.size1);
+		}
+		std::shared_ptr<std::vector<uint8_t>> decoded(new std::vector<uint8_t>(entry.size1));
+		decode_entry(*stream, entry, decoded->data(), end);
+		m_bitmaps.insert(key, decoded, decoded->size());
+		return decoded;
+	}
+
+	cache_counters header_counters() override {
+		return m_archives.counters();
+	}
+
+	cache_counters bitmap_counters() override {
+		return m_bitmaps.counters();
+	}
+};
+
+std::unique_ptr<entry_cache> entry_cache::create(const size_t header_bytes, const size_t bitmap_bytes, const size_t max_open) {
+	return std::unique_ptr<entry_cache>(new entry_cache_impl(header_bytes, bitmap_bytes, max_open));
+}
+
+// Answers requests on connections taken from a shared listening socket,
+// one connection at a time on each of its threads.
+struct server {
+	int m_socket;
+	entry_cache & m_cache;
+
+	inline server(const int socket, entry_cache & cache)
+	: m_socket(socket)
+	, m_cache(cache)
+	{}
+
+	void run(const size_t jobs) {
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < jobs; ++i) {
+			threads.emplace_back([this] { work(); });
+		}
+		work();
+		for (auto & thread : threads) {
+			thread.join();
+		}
+	}
+
+	// Longest request line taken, which leaves room for any path.
+	static constexpr size_t max_request = 32 + 4096;
+
+	void work() {
+		for (;;) {
+			const auto connection = ::accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC);
+			if (connection < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+				// Running out of descriptors or memory passes; the pause
+				// keeps a lasting failure from spinning.
+				fprintf(stderr, "accept: %s\n", strerror(errno));
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				continue;
+			}
+			try {
+				converse(connection);
+			} catch (const std::exception &) {
+				// The client went away mid-reply.
+			}
+			::close(connection);
+		}
+	}
+
+	// Reads requests off a connection until it closes.
+	void converse(const int connection) {
+		std::string buffer;
+		char block[4096];
+		for (;;) {
+			const auto newline = buffer.find('\n');
+			if (newline == std::string::npos) {
+				const auto len = ::recv(connection, block, sizeof(block), 0);
+				if (len < 0 && errno == EINTR) {
+					continue;
+				} else if (len < 0) {
+					throw std::system_error(errno, std::system_category());
+				} else if (len == 0) {
+					return;
+				}
+				buffer.append(block, len);
+				if (buffer.size() > max_request && buffer.find('\n') == std::string::npos) {
+					// There is no telling where the next request starts.
+					static const char reply[] = "ERR request too long\n";
+					send_all(connection, reply, sizeof(reply) - 1);
+					return;
+				}
+				continue;
+			}
+			const auto request = buffer.substr(0, newline);
+			buffer.erase(0, newline + 1);
+			std::shared_ptr<const std::vector<uint8_t>> bitmap;
+			try {
+				bitmap = request == "stats" ? report() : answer(request);
+			} catch (const std::exception & e) {
+				const auto reply = std::string("ERR ") + e.what() + "\n";
+				send_all(connection, reply.data(), reply.size());
+				continue;
+			}
+			char header[32];
+			const auto len = snprintf(header, sizeof(header), "OK %zu\n", bitmap->size());
+			send_all(connection, header, len);
+			send_all(connection, bitmap->data(), bitmap->size());
+		}
+	}
+
+	// Finds the entry a request names.
+	std::shared_ptr<const std::vector<uint8_t>> answer(const std::string & request) {
+		const auto space = request.find(' ');
+		if (space == std::string::npos || space == 0) {
+			throw error("bad request");
+		}
+		char * end;
+		errno = 0;
+		const auto index = strtoul(request.c_str(), &end, 10);
+		if (errno != 0 || end != request.c_str() + space || request[0] == '-' || request[0] == '+') {
+			throw error("bad request");
+		}
+		return m_cache.get(request.substr(space + 1), index);
+	}
+
+	// Describes each layer of the cache on a line of its own.
+	std::shared_ptr<const std::vector<uint8_t>> report() {
+		std::string text;
+		const std::pair<const char *, cache_counters> layers[] = {
+			{"headers", m_cache.header_counters()},
+			{"bitmaps", m_cache.bitmap_counters()},
+		};
+		for (const auto & layer : layers) {
+			char line[192];
+			snprintf(line, sizeof(line), "%s hits %llu misses %llu evictions %llu items %llu bytes %llu\n", layer.first,
+				(unsigned long long) layer.second.hits, (unsigned long long) layer.second.misses,
+				(unsigned long long) layer.second.evictions, (unsigned long long) layer.second.items,
+				(unsigned long long) layer.second.bytes);
+			text += line;
+		}
+		return std::make_shared<std::vector<uint8_t>>(text.begin(), text.end());
+	}
+
+	static void send_all(const int connection, const void * data, const size_t size) {
+		auto pos = static_cast<const uint8_t *>(data);
+		const auto end = pos + size;
+		while (pos < end) {
+			const auto len = ::send(connection, pos, end - pos, MSG_NOSIGNAL);
+			if (len < 0 && errno == EINTR) {
+				continue;
+			} else if (len < 0) {
+				throw std::system_error(errno, std::system_category());
+			}
+			pos += len;
+		}
+	}
+};
+
+void serve(const std::string & socket_path, const size_t jobs, entry_cache & cache) {
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(address.sun_path)) {
+		throw error("socket path too long: %s", socket_path.c_str());
+	}
+	memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+	const auto fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	// A socket left behind by an earlier daemon is taken over.
+	struct stat st;
+	if (::lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+		::unlink(socket_path.c_str());
+	}
+	// Only the daemon's user may connect, as it serves whatever that user
+	// can read.  The umask keeps the socket closed until chmod() sets
+	// the mode for certain.
+	const auto mask = ::umask(0077);
+	const auto bound = ::bind(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+	const auto saved = errno;
+	::umask(mask);
+	if (!bound || ::chmod(socket_path.c_str(), 0600) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+		const auto error = bound ? errno : saved;
+		::close(fd);
+		throw std::system_error(error, std::system_category());
+	}
+	try {
+		server(fd, cache).run(std::max<size_t>(jobs, 1));
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+}
+
+// Runs tasks on a fixed set of workers.  Each worker takes its own most
+// recently queued task first and steals the oldest queued task of another
+// worker when it runs dry.  Tasks must not throw.
+struct scheduler {
+	using task = std::function<void(size_t worker)>;
+
+	struct queue {
+		std::mutex m_mutex;
+		std::deque<task> m_tasks;
+	};
+
+	std::vector<std::unique_ptr<queue>> m_queues;
+	std::atomic<size_t> m_pending;
+	std::atomic<size_t> m_queued;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+
+	inline explicit scheduler(const size_t workers)
+	: m_pending(0)
+	, m_queued(0) {
+		for (size_t i = 0; i < workers; ++i) {
+			m_queues.emplace_back(new queue);
+		}
+	}
+
+	inline size_t size() const noexcept {
+		return m_queues.size();
+	}
+
+	void submit(const size_t worker, task work) {
+		++m_pending;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_queued;
+		}
+		{
+			auto & queue = *m_queues[worker % m_queues.size()];
+			std::lock_guard<std::mutex> lock(queue.m_mutex);
+			queue.m_tasks.push_back(std::move(work));
+		}
+		m_wake.notify_one();
+	}
+
+	bool take(const size_t worker, task & work) {
+		for (size_t i = 0; i < m_queues.size(); ++i) {
+			auto & queue = *m_queues[(worker + i) % m_queues.size()];
+			std::lock_guard<std::mutex> lock(queue.m_mutex);
+			if (!queue.m_tasks.empty()) {
+				if (i == 0) {
+					work = std::move(queue.m_tasks.back());
+					queue.m_tasks.pop_back();
+				} else {
+					work = std::move(queue.m_tasks.front());
+					queue.m_tasks.pop_front();
+				}
+				--m_queued;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void work(const size_t worker) {
+		for (;;) {
+			task work;
+			if (take(worker, work)) {
+				work(worker);
+				if (--m_pending == 0) {
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_wake.notify_all();
+				}
+			} else {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait(lock, [this] { return m_pending == 0 || m_queued > 0; });
+				if (m_pending == 0) {
+					return;
+				}
+			}
+		}
+	}
+
+	// Returns once every submitted task, including the ones submitted by
+	// tasks, has finished.  The calling thread acts as worker 0.
+	void run() {
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < m_queues.size(); ++i) {
+			threads.emplace_back(&scheduler::work, this, i);
+		}
+		work(0);
+		for (auto & thread : threads) {
+			thread.join();
+		}
+	}
+};
+
+struct batch_archive {
+	const extract_options & m_options;
+	std::string m_filename;
+	const std::vector<entry_range> & m_ranges;
+	std::vector<uint32_t> m_offsets;
+	bool m_selected;
+	std::vector<size_t> m_indices;
+	std::vector<size_t> m_ends;
+	std::vector<std::unique_ptr<ibufstream>> m_streams;
+	std::atomic<size_t> m_remaining;
+	std::atomic<bool> m_failed;
+	std::mutex m_mutex;
+	std::string m_output;
+	std::string m_errors;
+	bool m_done;
+
+	inline batch_archive(
+		const std::string & filename,
+		const std::vector<entry_range> & ranges,
+		const size_t workers,
+		const extract_options & options
+	)
+	: m_options(options)
+	, m_filename(filename)
+	, m_ranges(ranges)
+	, m_selected(false)
+	, m_streams(workers)
+	, m_remaining(0)
+	, m_failed(false)
+	, m_done(false)
+	{}
+
+	// Every worker reads through its own view of the archive.
+	ibufstream & stream(const size_t worker) {
+		auto & stream = m_streams[worker];
+		if (!stream) {
+			stream = open_archive(m_filename, m_options);
+		}
+		return *stream;
+	}
+
+	// Narrows the entries to extract down to ranges, in ascending order
+	// and without duplicates.
+	void select(const std::vector<entry_range> & ranges) {
+		m_selected = !ranges.empty();
+		for (const auto & range : ranges) {
+			const auto last = range.last == SIZE_MAX ? m_offsets.size() - 1 : range.last;
+			if (range.first >= m_offsets.size()) {
+				throw error("no entry %zu", range.first);
+			} else if (last >= m_offsets.size()) {
+				throw error("no entry %zu", last);
+			}
+			for (size_t i = range.first; i <= last; ++i) {
+				m_indices.push_back(i);
+			}
+		}
+		std::sort(m_indices.begin(), m_indices.end());
+		m_indices.erase(std::unique(m_indices.begin(), m_indices.end()), m_indices.end());
+	}
+
+	size_t count() const noexcept {
+		return m_selected ? m_indices.size() : m_offsets.size();
+	}
+
+	size_t index(const size_t i) const noexcept {
+		return m_selected ? m_indices[i] : i;
+	}
+
+	// Visits the selected entries in the order they lie in the archive.
+	void order_by_offset() {
+		if (!m_selected) {
+			m_indices.resize(m_offsets.size());
+			for (size_t i = 0; i < m_indices.size(); ++i) {
+				m_indices[i] = i;
+			}
+			m_selected = true;
+		}
+		const auto & offsets = m_offsets;
+		std::stable_sort(m_indices.begin(), m_indices.end(), [&offsets](const size_t a, const size_t b) {
+			return offsets[a] < offsets[b];
+		});
+	}
+
+	// Each entry ends where the next one up begins, the last one at the end
+	// of the archive, which is not known for an input that cannot seek.
+	void find_ends(const bool seekable) {
+		size_t size = SIZE_MAX;
+		if (seekable) {
+			struct stat st;
+			if (::stat(m_filename.c_str(), &st) != 0) {
+				throw std::system_error(errno, std::system_category());
+			}
+			size = st.st_size;
+		}
+		std::vector<uint32_t> sorted(m_offsets);
+		std::sort(sorted.begin(), sorted.end());
+		m_ends.resize(m_offsets.size());
+		for (size_t i = 0; i < m_offsets.size(); ++i) {
+			m_ends[i] = entry_end(sorted, m_offsets[i], size);
+		}
+	}
+
+	size_t end(const size_t index) const noexcept {
+		return m_ends.empty() ? SIZE_MAX : m_ends[index];
+	}
+
+	void warn(const char * what) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_errors += m_filename + ": " + what + "\n";
+	}
+
+	void fail(const char * what) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_failed) {
+			m_errors += m_filename + ": " + what + "\n";
+			m_failed = true;
+		}
+	}
+};
+
+// Extracts any number of archives through one scheduler.  Archives are
+// split into runs of entries so that the tail of a large archive is shared
+// out among all workers, and their messages are printed in input order.
+struct batch {
+	static constexpr size_t entries_per_task = 16;
+	// How many tasks ahead of the one being worked on are read ahead.
+	static constexpr size_t readahead_tasks = 4;
+
+	const extract_options & m_options;
+	scheduler m_scheduler;
+	std::vector<std::unique_ptr<batch_archive>> m_archives;
+	std::mutex m_mutex;
+	size_t m_reported;
+	size_t m_failures;
+
+	inline batch(
+		const std::vector<std::string> & input_filenames,
+		const size_t jobs,
+		const extract_options & options
+	)
+	: m_options(options)
+	, m_scheduler(jobs)
+	, m_reported(0)
+	, m_failures(0) {
+		for (size_t i = 0; i < input_filenames.size(); ++i) {
+			const auto & ranges = i < options.input_entries.size() ? options.input_entries[i] : options.entries;
+			m_archives.emplace_back(new batch_archive(input_filenames[i], ranges, jobs, options));
+		}
+	}
+
+	void open(batch_archive & archive, const size_t worker) {
+		try {
+			archive.m_output = archive.m_filename + "\n";
+			if (!m_options.use_index || !open_index(archive)) {
+				read_header(archive, worker);
+			}
+			archive.select(archive.m_ranges);
+			// Entries already end up in a container in no fixed order
+			// across threads, but in index order with one.
+			if (m_options.output == nullptr) {
+				archive.order_by_offset();
+			}
+			// The ends also bound the ranges that are read ahead.
+			if (!archive.m_offsets.empty()) {
+				archive.find_ends(archive.m_filename != "-" && archive.stream(worker).seekable());
+			}
+		} catch (const std::exception & e) {
+			archive.fail(e.what());
+			archive.m_offsets.clear();
+			archive.m_indices.clear();
+		}
+
+		collect();
+		const auto count = archive.count();
+		const auto tasks = (count + entries_per_task - 1) / entries_per_task;
+		if (count > 0 && !archive.stream(worker).seekable()) {
+			extract_forward(archive, worker);
+		} else if (tasks > 0) {
+			archive.m_remaining = tasks;
+			for (size_t task = 0; task < std::min(tasks, readahead_tasks); ++task) {
+				advise(archive, worker, task, ifstream::advice::will_need);
+			}
+			// Submitted last to first, as a worker takes its own newest
+			// task first.
+			for (size_t task = tasks; task-- > 0;) {
+				m_scheduler.submit(worker, [this, &archive, task](const size_t worker) {
+					extract_task(archive, task, worker);
+				});
+			}
+		} else {
+			finish(archive);
+		}
+	}
+
+	void read_header(batch_archive & archive, const size_t worker) {
+		auto & stream = archive.stream(worker);
+		if (!read_offsets(stream, archive.m_offsets)) {
+			archive.m_output += "Does not contain images\n";
+		} else if (m_options.use_index && !m_options.verify && stream.seekable()) {
+			save_sidecar(archive, scan_entries(stream, archive.m_offsets));
+		}
+	}
+
+	// A missing, stale or unreadable index only costs a header read.
+	bool open_index(batch_archive & archive) {
+		std::vector<archive_entry> entries;
+		try {
+			if (!load_index(archive.m_filename, entries)) {
+				return false;
+			}
+		} catch (const std::exception & e) {
+			archive.warn((std::string("ignoring index: ") + e.what()).c_str());
+			return false;
+		}
+		archive.m_offsets.resize(entries.size());
+		for (size_t i = 0; i < entries.size(); ++i) {
+			archive.m_offsets[i] = entries[i].offset;
+		}
+		return true;
+	}
+
+	void save_sidecar(batch_archive & archive, const std::vector<archive_entry> & entries) {
+		try {
+			save_index(archive.m_filename, entries);
+		} catch (const std::exception & e) {
+			archive.warn((std::string("cannot save index: ") + e.what()).c_str());
+		}
+	}
+
+	// Visits the entries in the order they are stored so that an archive
+	// read from a pipe is decoded in a single pass.  A container receives
+	// them in that order too, as putting them back in index order would
+	// mean holding on to all of them.
+	void extract_forward(batch_archive & archive, const size_t worker) {
+		const auto & offsets = archive.m_offsets;
+		std::vector<size_t> order(archive.count());
+		for (size_t i = 0; i < order.size(); ++i) {
+			order[i] = archive.index(i);
+		}
+		std::stable_sort(order.begin(), order.end(), [&offsets](const size_t a, const size_t b) {
+			return offsets[a] < offsets[b];
+		});
+		try {
+			auto & stream = archive.stream(worker);
+			bitmap_names names(archive.m_filename, extension());
+			for (const auto i : order) {
+				extract_one(archive, stream, names, i);
+			}
+			if (m_options.io_uring) {
+				uring::drain_local();
+			}
+		} catch (const std::exception & e) {
+			archive.fail(e.what());
+		}
+		collect();
+		finish(archive);
+	}
+
+	// Errors name the entry they came from.
+	void extract_one(batch_archive & archive, ibufstream & stream, bitmap_names & names, const size_t index) {
+		try {
+			if (m_options.verify) {
+				verify_offset(archive, index);
+			}
+			timed_extract(archive, stream, names, index);
+		} catch (const std::exception & e) {
+			throw error("entry %zu: %s", index, e.what());
+		}
+	}
+
+	void verify_offset(const batch_archive & archive, const size_t index) {
+		const auto offset = archive.m_offsets[index];
+		const auto header = 1 + 8 + 4 + archive.m_offsets.size() * sizeof(uint32_t);
+		if (offset < header) {
+			throw error("offset %u is inside the header", offset);
+		} else if (archive.end(index) <= offset) {
+			throw error("offset %u is past the end of the archive", offset);
+		}
+	}
+
+	void timed_extract(batch_archive & archive, ibufstream & stream, bitmap_names & names, const size_t index) {
+		const auto offset = archive.m_offsets[index];
+		if (m_options.stats == nullptr) {
+			extract_entry(stream, names, index, offset, m_options, archive.end(index));
+			return;
+		}
+		const auto start = std::chrono::steady_clock::now();
+		extract_entry(stream, names, index, offset, m_options, archive.end(index));
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		const uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+		auto & stats = extract_stats::local();
+		++stats.entries;
+		stats.entry_nanoseconds += nanoseconds;
+		stats.max_entry_nanoseconds = std::max(stats.max_entry_nanoseconds, nanoseconds);
+	}
+
+	const char * extension() const noexcept {
+		return m_options.encoder != nullptr ? m_options.encoder->extension() : ".bmp";
+	}
+
+	// Hands what this thread has counted over to options.stats.
+	void collect() {
+		if (m_options.stats != nullptr) {
+			auto & stats = extract_stats::local();
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_options.stats->add(stats);
+			stats = extract_stats{};
+		}
+	}
+
+	// Passes advice on the part of the archive that task covers.
+	void advise(batch_archive & archive, const size_t worker, const size_t task, const ifstream::advice advice) {
+		const auto begin = task * entries_per_task;
+		const auto end = std::min(begin + entries_per_task, archive.count());
+		if (archive.m_ends.empty() || begin >= end) {
+			return;
+		}
+		size_t first = SIZE_MAX;
+		size_t last = 0;
+		for (size_t i = begin; i < end; ++i) {
+			const auto index = archive.index(i);
+			first = std::min<size_t>(first, archive.m_offsets[index]);
+			last = std::max(last, archive.end(index));
+		}
+		if (first < last) {
+			archive.stream(worker).advise(first, last - first, advice);
+		}
+	}
+
+	void extract_task(batch_archive & archive, const size_t task, const size_t worker) {
+		advise(archive, worker, task + readahead_tasks, ifstream::advice::will_need);
+		const auto begin = task * entries_per_task;
+		extract_entries(archive, begin, std::min(begin + entries_per_task, archive.count()), worker);
+		if (m_options.drop_input) {
+			advise(archive, worker, task, ifstream::advice::dont_need);
+		}
+		if (--archive.m_remaining == 0) {
+			finish(archive);
+		}
+	}
+
+	void extract_entries(batch_archive & archive, const size_t begin, const size_t end, const size_t worker) {
+		try {
+			auto & stream = archive.stream(worker);
+			bitmap_names names(archive.m_filename, extension());
+			for (size_t i = begin; i < end && !archive.m_failed; ++i) {
+				extract_one(archive, stream, names, archive.index(i));
+			}
+			if (m_options.io_uring) {
+				uring::drain_local();
+			}
+		} catch (const std::exception & e) {
+			archive.fail(e.what());
+		}
+		collect();
+	}
+
+	void finish(batch_archive & archive) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		archive.m_done = true;
+		archive.m_offsets = std::vector<uint32_t>{};
+		archive.m_indices = std::vector<size_t>{};
+		archive.m_ends = std::vector<size_t>{};
+		archive.m_streams = std::vector<std::unique_ptr<ibufstream>>{};
+		for (; m_reported < m_archives.size() && m_archives[m_reported]->m_done; ++m_reported) {
+			auto & done = *m_archives[m_reported];
+			if (!m_options.quiet) {
+				fputs(done.m_output.c_str(), stdout);
+				fflush(stdout);
+			}
+			fputs(done.m_errors.c_str(), stderr);
+			if (done.m_failed) {
+				++m_failures;
+			}
+			done.m_output = std::string{};
+			done.m_errors = std::string{};
+		}
+	}
+
+	// Returns the number of archives that could not be extracted.
+	size_t run() {
+		// Submitted last to first, as a worker takes its own newest task
+		// first and the messages are printed in input order.
+		for (size_t i = m_archives.size(); i-- > 0;) {
+			auto & archive = *m_archives[i];
+			m_scheduler.submit(i, [this, &archive](const size_t worker) {
+				open(archive, worker);
+			});
+		}
+		m_scheduler.run();
+		return m_failures;
+	}
+};
+
+constexpr size_t batch::entries_per_task;
+constexpr size_t batch::readahead_tasks;
+
+size_t extract(
+	const std::vector<std::string> & input_filenames,
+	const size_t jobs,
+	const extract_options & options
+) {
+	return batch(input_filenames, jobs, options).run();
+}
+
+// A byte of compressed output is reckoned to take this many times as long
+// as a plain one, which is mostly copied by the kernel.
+constexpr uint64_t compressed_cost = 4;
+
+uint64_t entry_cost(const archive_entry & entry) noexcept {
+	return entry.type == 9 ? uint64_t(entry.size1) * compressed_cost : entry.size1;
+}
+
+// Entries whose header cannot be read are kept with type 0, to be reported
+// by whichever shard gets them.
+manifest_archive plan_archive(const std::string & filename, const bool use_index) {
+	manifest_archive result;
+	result.filename = filename;
+	if (use_index && load_index(filename, result.entries)) {
+		return result;
+	}
+	const auto stream = ibufstream::open(filename);
+	std::vector<uint32_t> offsets;
+	read_offsets(*stream, offsets);
+	result.entries.resize(offsets.size());
+	for (size_t i = 0; i < offsets.size(); ++i) {
+		try {
+			result.entries[i] = read_entry(*stream, offsets[i]);
+		} catch (const std::exception &) {
+			result.entries[i] = archive_entry{offsets[i], 0, 0, 0};
+		}
+	}
+	return result;
+}
+
+size_t plan_manifest(
+	const std::vector<std::string> & input_filenames,
+	const size_t jobs,
+	const bool use_index,
+	std::vector<manifest_archive> & manifest
+) {
+	std::vector<manifest_archive> planned(input_filenames.size());
+	std::vector<std::string> errors(input_filenames.size());
+	std::atomic<size_t> next(0);
+	const auto work = [&] {
+		for (size_t i; (i = next++) < input_filenames.size();) {
+			try {
+				planned[i] = plan_archive(input_filenames[i], use_index);
+			} catch (const std::exception & e) {
+				errors[i] = e.what();
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < jobs; ++i) {
+		threads.emplace_back(work);
+	}
+	work();
+	for (auto & thread : threads) {
+		thread.join();
+	}
+	size_t failures = 0;
+	for (size_t i = 0; i < planned.size(); ++i) {
+		if (errors[i].empty()) {
+			manifest.push_back(std::move(planned[i]));
+		} else {
+			fprintf(stderr, "%s: %s\n", input_filenames[i].c_str(), errors[i].c_str());
+			++failures;
+		}
+	}
+	return failures;
+}
+
+void save_manifest(const std::string & filename, const std::vector<manifest_archive> & manifest) {
+	std::string text = "risconvert-manifest 1\n";
+	for (const auto & archive : manifest) {
+		if (archive.filename.find('\n') != std::string::npos) {
+			throw error("newline in filename: %s", archive.filename.c_str());
+		}
+		text += "archive " + archive.filename + "\n";
+		for (size_t i = 0; i < archive.entries.size(); ++i) {
+			const auto & entry = archive.entries[i];
+			char line[64];
+			snprintf(line, sizeof(line), "%zu %u %u %u %u\n", i, entry.offset, entry.type, entry.size1, entry.size2);
+			text += line;
+		}
+	}
+	std::unique_ptr<ofstream> output;
+	if (filename == "-") {
+		const auto fd = ::fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0) {
+			throw std::system_error(errno, std::system_category());
+		}
+		output.reset(new ofstream_impl(fd));
+	} else {
+		output = ofstream::create(filename);
+	}
+	output->write(text.data(), text.size());
+}
+
+std::vector<manifest_archive> load_manifest(const std::string & filename) {
+	FILE * const file = filename == "-" ? stdin : fopen(filename.c_str(), "r");
+	if (file == nullptr) {
+		throw std::system_error(errno, std::system_category());
+	}
+	std::vector<manifest_archive> manifest;
+	char * line = nullptr;
+	size_t capacity = 0;
+	size_t number = 0;
+	std::string problem;
+	for (ssize_t len; problem.empty() && (len = getline(&line, &capacity, file)) >= 0;) {
+		++number;
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		unsigned long long index, offset, type, size1, size2;
+		char end;
+		if (number == 1) {
+			if (strcmp(line, "risconvert-manifest 1") != 0) {
+				problem = "not a manifest";
+			}
+		} else if (strncmp(line, "archive ", 8) == 0) {
+			manifest.push_back(manifest_archive{line + 8, {}});
+		} else if (manifest.empty() || sscanf(line, "%llu %llu %llu %llu %llu%c", &index, &offset, &type, &size1, &size2, &end) != 5
+			|| index != manifest.back().entries.size() || offset > UINT32_MAX || type > UINT8_MAX || size1 > UINT32_MAX || size2 > UINT32_MAX) {
+			problem = "bad entry";
+		} else {
+			manifest.back().entries.push_back(archive_entry{uint32_t(offset), uint8_t(type), uint32_t(size1), uint32_t(size2)});
+		}
+	}
+	free(line);
+	if (file != stdin) {
+		fclose(file);
+	}
+	if (!problem.empty()) {
+		throw error("%s:%zu: %s", filename.c_str(), number, problem.c_str());
+	} else if (number == 0) {
+		throw error("%s: not a manifest", filename.c_str());
+	}
+	return manifest;
+}
+
+// Hands the costliest entries out first, each to the shard with the least
+// so far, ties going to the earlier entry and the lower shard.
+std::vector<std::vector<entry_range>> shard_manifest(
+	const std::vector<manifest_archive> & manifest,
+	const size_t shard,
+	const size_t count
+) {
+	if (shard >= count) {
+		throw error("no shard %zu of %zu", shard + 1, count);
+	}
+	struct item {
+		uint64_t cost;
+		size_t archive;
+		size_t index;
+	};
+	std::vector<item> items;
+	for (size_t a = 0; a < manifest.size(); ++a) {
+		for (size_t i = 0; i < manifest[a].entries.size(); ++i) {
+			items.push_back(item{entry_cost(manifest[a].entries[i]), a, i});
+		}
+	}
+	std::stable_sort(items.begin(), items.end(), [](const item & a, const item & b) {
+		return a.cost > b.cost;
+	});
+	using load = std::pair<uint64_t, size_t>;
+	std::priority_queue<load, std::vector<load>, std::greater<load>> loads;
+	for (size_t i = 0; i < count; ++i) {
+		loads.emplace(0, i);
+	}
+	std::vector<std::vector<size_t>> mine(manifest.size());
+	for (const auto & item : items) {
+		auto least = loads.top();
+		loads.pop();
+		if (least.second == shard) {
+			mine[item.archive].push_back(item.index);
+		}
+		least.first += item.cost;
+		loads.push(least);
+	}
+	std::vector<std::vector<entry_range>> result(manifest.size());
+	for (size_t a = 0; a < manifest.size(); ++a) {
+		auto & indices = mine[a];
+		std::sort(indices.begin(), indices.end());
+		for (const auto index : indices) {
+			if (!result[a].empty() && result[a].back().last + 1 == index) {
+				result[a].back().last = index;
+			} else {
+				result[a].push_back(entry_range{index, index});
+			}
+		}
+	}
+	return result;
+}